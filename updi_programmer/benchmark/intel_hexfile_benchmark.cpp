@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "intel_hexfile.h"
+
+using namespace std;
+using namespace chrono;
+using namespace updi;
+
+/*
+ * Compares IntelHexFile with the former record parser, which decoded every
+ * hex pair through a std::stringstream.
+ *
+ * Usage: intel_hexfile_benchmark [image size in KB] [iterations]
+ *
+ * The former parser only runs on images up to 64 KB.
+ */
+
+constexpr uint32_t PAGE_SIZE = 256;
+
+static uint64_t asciiHexTo64(string s) {
+    stringstream o;
+    o << hex << s;
+    uint64_t v;
+    o >> v;
+    return v;
+}
+
+// Former IntelHexFile::parse_record, kept as the baseline
+static int legacy_parse_record(const string& record, vector<uint8_t>& data) {
+    if (record[0] != ':') {
+        return -1;
+    }
+
+    uint8_t  count = 2 * asciiHexTo64(record.substr(1, 2));
+    uint8_t  high_addr = asciiHexTo64(record.substr(3, 2));
+    uint8_t  low_addr = asciiHexTo64(record.substr(5, 2));
+    uint16_t start_addr = ((high_addr << 8) | low_addr);
+    uint8_t  recordType = asciiHexTo64(record.substr(7, 2));
+
+    if (recordType != 0 && recordType != 1) {
+        return -1;
+    }
+
+    uint8_t cChecksum = (count / 2) + high_addr + low_addr + recordType;
+
+    if (count != record.length() - (9 + 2 + 1)) {
+        return -1;
+    }
+
+    for (uint8_t i = 0; i < count; i += 2) {
+        uint8_t v = asciiHexTo64(record.substr(9 + i, 2));
+        cChecksum += v;
+        if ((start_addr + i / 2) > data.size()) {
+            return -1;
+        }
+        data[start_addr + i / 2] = v;
+    }
+
+    uint8_t checksum = asciiHexTo64(record.substr(record.length() - 3, 2));
+    if (((uint8_t)(cChecksum + checksum)) != 0) {
+        return -1;
+    }
+
+    return start_addr;
+}
+
+static void legacy_load_file(const string& filename, uint32_t flash_size) {
+    char            rec_line[524] = {0};
+    ifstream        file(filename.c_str());
+    vector<uint8_t> data(flash_size);
+
+    while (true) {
+        file.getline(rec_line, 524);
+        string record = rec_line;
+        if (!file || record.empty()) {
+            break;
+        }
+
+        if (legacy_parse_record(record, data) < 0) {
+            throw ios_base::failure("legacy parser failed");
+        }
+        memset(rec_line, 0, 524);
+    }
+}
+
+// 16 data bytes per record with CRLF line endings, images beyond 64 KB get
+// extended linear address records
+static void write_image(const string& filename, uint32_t size) {
+    ofstream file(filename.c_str(), ios::out | ios::trunc | ios::binary);
+    char     record[64];
+
+    srand(1);
+    for (uint32_t addr = 0; addr < size; addr += 16) {
+        if (addr && addr % 0x10000 == 0) {
+            uint8_t upper = addr >> 16;
+            sprintf(record, ":02000004%04X%02X\r\n", upper,
+                    (uint8_t)-(2 + 4 + upper));
+            file << record;
+        }
+
+        uint8_t sum = 16 + (addr >> 8) + addr;
+        int     n = sprintf(record, ":10%04X00", addr & 0xFFFF);
+        for (int i = 0; i < 16; i++) {
+            uint8_t b = rand();
+            sum += b;
+            n += sprintf(record + n, "%02X", b);
+        }
+        sprintf(record + n, "%02X\r\n", (uint8_t)-sum);
+        file << record;
+    }
+    file << ":00000001FF\r\n";
+}
+
+template <typename F>
+static double run(const char* name, uint32_t iterations, F load) {
+    auto start = steady_clock::now();
+    for (uint32_t i = 0; i < iterations; i++) {
+        load();
+    }
+    double ms =
+        duration_cast<microseconds>(steady_clock::now() - start).count() /
+        1000.0 / iterations;
+
+    cout << name << ": " << ms << " ms per image" << endl;
+    return ms;
+}
+
+int main(int argc, char** argv) {
+    uint32_t size_kb = argc > 1 ? atoi(argv[1]) : 128;
+    uint32_t iterations = argc > 2 ? atoi(argv[2]) : 20;
+    uint32_t size = size_kb * 1024;
+    string   filename = "/tmp/intel_hexfile_benchmark.hex";
+    double   legacy_ms = 0;
+
+    if (size == 0 || iterations == 0) {
+        cerr << "Usage: " << argv[0] << " [image size in KB] [iterations]"
+             << endl;
+        return -1;
+    }
+
+    write_image(filename, size);
+    cout << "Image of " << size_kb << " KB, " << iterations << " iterations"
+         << endl;
+
+    // The former parser only handled 16 bit addresses
+    if (size <= 64 * 1024) {
+        legacy_ms = run("legacy parser", iterations, [&]() {
+            legacy_load_file(filename, size);
+        });
+    }
+
+    // The loader reports the image size on stdout
+    auto   cout_buf = cout.rdbuf();
+    double table_ms = run("table parser ", iterations, [&]() {
+        cout.rdbuf(nullptr);
+        IntelHexFile hex_file(size, PAGE_SIZE);
+        hex_file.load_file(filename);
+        cout.rdbuf(cout_buf);
+    });
+
+    if (legacy_ms > 0) {
+        cout << "speedup " << legacy_ms / table_ms << "x" << endl;
+    }
+    remove(filename.c_str());
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "data_sampler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+using namespace chrono;
+
+namespace updi {
+
+// Starting a new burst costs a pointer setup (up to 5 bytes + ACK),
+// a REPEAT (3 bytes) and the LD instruction (2 bytes).
+// Reading through a gap of up to that many bytes is cheaper.
+constexpr uint32_t MAX_MERGED_GAP = 10;
+
+DataSampler::DataSampler(NvmProgrammer&               nvm,
+                         const vector<SampleChannel>& channels)
+    : nvm_programmer(nvm),
+      sample_channels(channels),
+      stopped(false),
+      sample_rate(0) {
+    plan_bursts();
+}
+
+DataSampler::~DataSampler() {
+}
+
+vector<SampleChannel> DataSampler::parse_channels(const string& list) {
+    vector<SampleChannel> channels;
+    stringstream          ss(list);
+    string                entry;
+
+    while (getline(ss, entry, ',')) {
+        SampleChannel channel;
+        size_t        pos = 0;
+
+        try {
+            channel.address = stoul(entry, &pos, 0);
+            channel.size = 1;
+            if (pos < entry.size() && entry[pos] == ':') {
+                string size = entry.substr(pos + 1);
+                channel.size = stoul(size, &pos, 0);
+                pos += entry.size() - size.size();
+            }
+        } catch (const logic_error&) {
+            pos = 0;
+        }
+
+        // Values are written as integers of up to 64 bits
+        if (pos == 0 || pos != entry.size() || channel.size == 0 ||
+            channel.size > 8) {
+            throw invalid_argument("Invalid sample channel " + entry);
+        }
+        channels.push_back(channel);
+    }
+
+    if (channels.empty()) {
+        throw invalid_argument("No sample channel");
+    }
+
+    return channels;
+}
+
+void DataSampler::run(ostream& out, uint32_t sample_count) {
+    vector<vector<uint8_t>> burst_data(bursts.size());
+    uint32_t                samples = 0;
+
+    out << "time_us";
+    for (auto& channel : sample_channels) {
+        out << ",0x" << hex << channel.address << dec;
+    }
+    out << endl;
+
+    stopped = false;
+    auto start = steady_clock::now();
+    while (!stopped && (sample_count == 0 || samples < sample_count)) {
+        auto timestamp =
+            duration_cast<microseconds>(steady_clock::now() - start).count();
+
+        for (size_t i = 0; i < bursts.size(); i++) {
+            burst_data[i] =
+                nvm_programmer.read_memory(bursts[i].address, bursts[i].size);
+
+            // A read timing out returns the bytes received so far
+            if (burst_data[i].size() != bursts[i].size) {
+                stringstream ss;
+                ss << "Short read at 0x" << hex << bursts[i].address << ": "
+                   << dec << burst_data[i].size() << " of " << bursts[i].size
+                   << " bytes";
+                throw UpdiException(ss.str());
+            }
+        }
+
+        out << timestamp;
+        for (auto& channel : sample_channels) {
+            // Locate the channel inside the burst that covers it
+            for (size_t i = 0; i < bursts.size(); i++) {
+                if (channel.address < bursts[i].address ||
+                    channel.address + channel.size >
+                        bursts[i].address + bursts[i].size) {
+                    continue;
+                }
+
+                uint32_t offset = channel.address - bursts[i].address;
+                uint64_t value = 0;
+                for (uint32_t n = channel.size; n > 0; n--) {
+                    value = (value << 8) | burst_data[i][offset + n - 1];
+                }
+                out << ',' << value;
+                break;
+            }
+        }
+        out << '\n';
+        samples++;
+    }
+    out.flush();
+
+    auto elapsed =
+        duration_cast<microseconds>(steady_clock::now() - start).count();
+    sample_rate = elapsed ? (samples * 1000000.0 / elapsed) : 0;
+}
+
+void DataSampler::plan_bursts() {
+    vector<SampleChannel> sorted = sample_channels;
+    sort(sorted.begin(), sorted.end(),
+         [](const SampleChannel& a, const SampleChannel& b) {
+             return a.address < b.address;
+         });
+
+    bursts.clear();
+    for (auto& channel : sorted) {
+        uint32_t end = channel.address + channel.size;
+
+        if (!bursts.empty()) {
+            Burst&   last = bursts.back();
+            uint32_t last_end = last.address + last.size;
+            uint32_t merged_end = max(last_end, end);
+
+            if (channel.address <= last_end + MAX_MERGED_GAP &&
+                merged_end - last.address <= UPDI_MAX_REPEAT_SIZE) {
+                last.size = merged_end - last.address;
+                continue;
+            }
+        }
+
+        Burst burst;
+        burst.address = channel.address;
+        burst.size = channel.size;
+        bursts.push_back(burst);
+    }
+}
+
+}  // namespace updi
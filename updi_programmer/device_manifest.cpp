@@ -0,0 +1,106 @@
+#include "device_manifest.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "device.h"
+
+using namespace std;
+
+namespace updi {
+
+DeviceManifest::DeviceManifest() {
+}
+
+DeviceManifest::~DeviceManifest() {
+}
+
+void DeviceManifest::load_file(const string& filename) {
+    ifstream file(filename.c_str());
+    string   line;
+    int      line_number = 0;
+    string   directory;
+
+    if (!file.is_open()) {
+        stringstream ss;
+        ss << "failed to open file " << filename;
+        throw ios_base::failure(ss.str());
+    }
+
+    size_t separator = filename.rfind('/');
+    if (separator != string::npos) {
+        directory = filename.substr(0, separator + 1);
+    }
+
+    auto resolve = [&directory](const string& path) {
+        return (path.empty() || path[0] == '/') ? path : directory + path;
+    };
+
+    entries.clear();
+    while (getline(file, line)) {
+        line_number++;
+
+        size_t comment = line.find('#');
+        if (comment != string::npos) {
+            line.erase(comment);
+        }
+
+        stringstream  ls(line);
+        string        signature;
+        ManifestEntry entry;
+        string        error;
+
+        if (!(ls >> signature)) {
+            continue;
+        }
+
+        if (!(ls >> entry.device_name >> entry.image_file)) {
+            error = "expected <signature> <device> <image> [fuse profile]";
+        } else {
+            ls >> entry.fuse_file;
+            try {
+                entry.signature = stoul(signature, nullptr, 16);
+            } catch (const logic_error& e) {
+                error = "invalid signature " + signature;
+            }
+        }
+
+        if (error.empty() && AvrDevice::get_supported_devices().find(
+                                 entry.device_name) == string::npos) {
+            error = "device " + entry.device_name + " is not supported";
+        }
+
+        if (error.empty() && find(entry.signature)) {
+            error = "signature " + signature + " is listed twice";
+        }
+
+        if (!error.empty()) {
+            stringstream ss;
+            ss << filename << ":" << line_number << ": " << error;
+            throw ios_base::failure(ss.str());
+        }
+
+        entry.image_file = resolve(entry.image_file);
+        entry.fuse_file = resolve(entry.fuse_file);
+        entries.push_back(entry);
+    }
+
+    if (entries.empty()) {
+        stringstream ss;
+        ss << filename << ": no devices listed";
+        throw ios_base::failure(ss.str());
+    }
+}
+
+const ManifestEntry* DeviceManifest::find(uint32_t signature) const {
+    for (auto& entry : entries) {
+        if (entry.signature == signature) {
+            return &entry;
+        }
+    }
+
+    return nullptr;
+}
+
+}  // namespace updi
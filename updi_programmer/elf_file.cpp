@@ -0,0 +1,225 @@
+#include "elf_file.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace updi {
+
+// Load addresses of the memories in avr-gcc linker scripts, each memory has
+// a 64 KB window
+constexpr uint32_t LMA_FLASH_END = 0x800000;
+constexpr uint32_t LMA_EEPROM = 0x810000;
+constexpr uint32_t LMA_FUSE = 0x820000;
+constexpr uint32_t LMA_LOCK = 0x830000;
+constexpr uint32_t LMA_SIGNATURE = 0x840000;
+constexpr uint32_t LMA_USER_SIGNATURES = 0x850000;
+constexpr uint32_t LMA_WINDOW_SIZE = 0x10000;
+
+static uint16_t read_le16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool in_window(uint32_t address, uint32_t window) {
+    return address >= window && address < window + LMA_WINDOW_SIZE;
+}
+
+static void throw_error(const string& name, const string& message) {
+    string error = name + ": " + message;
+    cerr << error << endl;
+    throw ios_base::failure(error);
+}
+
+// Read everything from a descriptor mmap can't map, e.g. a pipe
+static bool read_all(int fd, string& content) {
+    char buffer[65536];
+
+    while (true) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        content.append(buffer, n);
+    }
+}
+
+ElfFile::ElfFile(uint32_t flash_size, uint32_t page_size)
+    : flash(flash_size, page_size) {
+}
+
+ElfFile::~ElfFile() {
+}
+
+bool ElfFile::is_elf_file(const string& filename) {
+    char magic[SELFMAG];
+    int  fd = open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool elf = read(fd, magic, SELFMAG) == SELFMAG &&
+               memcmp(magic, ELFMAG, SELFMAG) == 0;
+    close(fd);
+    return elf;
+}
+
+void ElfFile::load_file(const string& filename) {
+    string content;
+
+    if (filename == "-") {
+        if (!read_all(STDIN_FILENO, content)) {
+            throw ios_base::failure("failed to read standard input");
+        }
+        load_buffer((const uint8_t*)content.data(), content.size(),
+                    "<stdin>");
+        return;
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        stringstream ss;
+        ss << "failed to open file " << filename;
+        throw ios_base::failure(ss.str());
+    }
+
+    struct stat st;
+    void*       mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    if (mapping == MAP_FAILED) {
+        bool success = read_all(fd, content);
+        close(fd);
+        if (!success) {
+            stringstream ss;
+            ss << "failed to read file " << filename;
+            throw ios_base::failure(ss.str());
+        }
+        load_buffer((const uint8_t*)content.data(), content.size(),
+                    filename);
+        return;
+    }
+
+    close(fd);
+
+    try {
+        load_buffer((const uint8_t*)mapping, st.st_size, filename);
+    } catch (...) {
+        munmap(mapping, st.st_size);
+        throw;
+    }
+
+    munmap(mapping, st.st_size);
+}
+
+void ElfFile::load_buffer(const uint8_t* data,
+                          size_t         size,
+                          const string&  name) {
+    vector<ImageSegment> flash_segments;
+
+    eeprom.clear();
+    user_row.clear();
+    fuses.clear();
+
+    if (size < sizeof(Elf32_Ehdr) || memcmp(data, ELFMAG, SELFMAG) != 0) {
+        throw_error(name, "not an ELF file");
+    }
+    if (data[EI_CLASS] != ELFCLASS32 || data[EI_DATA] != ELFDATA2LSB) {
+        throw_error(name, "not a 32 bit little endian ELF file");
+    }
+    if (read_le16(data + offsetof(Elf32_Ehdr, e_machine)) != EM_AVR) {
+        throw_error(name, "not an AVR executable");
+    }
+
+    uint32_t ph_offset = read_le32(data + offsetof(Elf32_Ehdr, e_phoff));
+    uint16_t ph_size = read_le16(data + offsetof(Elf32_Ehdr, e_phentsize));
+    uint16_t ph_count = read_le16(data + offsetof(Elf32_Ehdr, e_phnum));
+    if (ph_count == 0) {
+        throw_error(name, "no program headers");
+    }
+    if (ph_size < sizeof(Elf32_Phdr) ||
+        (uint64_t)ph_offset + (uint64_t)ph_count * ph_size > size) {
+        throw_error(name, "program headers exceed the file");
+    }
+
+    // Program headers carry the load address of every allocated section
+    for (uint16_t n = 0; n < ph_count; n++) {
+        const uint8_t* ph = data + ph_offset + n * ph_size;
+        uint32_t       type = read_le32(ph + offsetof(Elf32_Phdr, p_type));
+        uint32_t offset = read_le32(ph + offsetof(Elf32_Phdr, p_offset));
+        uint32_t address = read_le32(ph + offsetof(Elf32_Phdr, p_paddr));
+        uint32_t file_size = read_le32(ph + offsetof(Elf32_Phdr, p_filesz));
+
+        // .bss and .noinit have nothing to program
+        if (type != PT_LOAD || file_size == 0) {
+            continue;
+        }
+
+        if ((uint64_t)offset + file_size > size) {
+            stringstream ss;
+            ss << "segment at 0x" << hex << address << " exceeds the file";
+            throw_error(name, ss.str());
+        }
+
+        ImageSegment segment;
+        segment.data.assign(data + offset, data + offset + file_size);
+
+        if (address < LMA_FLASH_END) {
+            segment.address = address;
+            flash_segments.push_back(move(segment));
+        } else if (in_window(address, LMA_EEPROM)) {
+            segment.address = address - LMA_EEPROM;
+            eeprom.push_back(move(segment));
+        } else if (in_window(address, LMA_FUSE)) {
+            for (uint32_t i = 0; i < file_size; i++) {
+                fuses[address - LMA_FUSE + i] = segment.data[i];
+            }
+        } else if (in_window(address, LMA_USER_SIGNATURES)) {
+            segment.address = address - LMA_USER_SIGNATURES;
+            user_row.push_back(move(segment));
+        } else if (in_window(address, LMA_LOCK)) {
+            cerr << name << ": lock bits are not written" << endl;
+        } else if (!in_window(address, LMA_SIGNATURE)) {
+            stringstream ss;
+            ss << "segment at 0x" << hex << address
+               << " is outside the AVR memories";
+            throw_error(name, ss.str());
+        }
+    }
+
+    auto by_address = [](const ImageSegment& a, const ImageSegment& b) {
+        return a.address < b.address;
+    };
+    sort(eeprom.begin(), eeprom.end(), by_address);
+    sort(user_row.begin(), user_row.end(), by_address);
+
+    flash.load_segments(move(flash_segments), name);
+    cout << "EEPROM segments " << eeprom.size() << ", user row segments "
+         << user_row.size() << ", fuses " << fuses.size() << endl;
+}
+
+}  // namespace updi
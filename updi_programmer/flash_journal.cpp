@@ -0,0 +1,170 @@
+#include "flash_journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+namespace updi {
+
+constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+constexpr uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+static uint64_t fnv1a(uint64_t hash, uint8_t value) {
+    return (hash ^ value) * FNV_PRIME;
+}
+
+static void throw_write_error(const string& filename) {
+    stringstream ss;
+    ss << "failed to write file " << filename;
+    throw ios_base::failure(ss.str());
+}
+
+static bool write_all(int fd, const string& data) {
+    size_t done = 0;
+
+    while (done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// The rename itself only survives a power loss once the directory is synced
+static void sync_directory(const string& filename) {
+    size_t slash = filename.rfind('/');
+    string directory = slash == string::npos ? "." : filename.substr(0, slash);
+    int    dir_fd = ::open(directory.empty() ? "/" : directory.c_str(),
+                           O_RDONLY | O_DIRECTORY);
+
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+FlashJournal::FlashJournal(const string& filename)
+    : filename(filename), fd(-1) {
+}
+
+FlashJournal::~FlashJournal() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+uint64_t FlashJournal::image_hash(const vector<ProgramPage>& pages) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (auto& page : pages) {
+        for (int i = 0; i < 4; i++) {
+            hash = fnv1a(hash, (page.address >> (8 * i)) & 0xFF);
+        }
+        for (size_t i = 0; i < page.pageSize; i++) {
+            hash = fnv1a(hash, page.data[i]);
+        }
+    }
+
+    return hash;
+}
+
+bool FlashJournal::open(uint64_t image_hash, const vector<uint8_t>& device_id) {
+    stringstream header;
+    string       line;
+
+    header << "image " << hex << setfill('0') << setw(16) << image_hash
+           << " device ";
+    for (auto b : device_id) {
+        header << setw(2) << (int)b;
+    }
+
+    completed.clear();
+
+    ifstream previous(filename.c_str());
+    if (getline(previous, line) && line == header.str()) {
+        while (getline(previous, line)) {
+            stringstream ss(line);
+            string       tag;
+            uint32_t     address;
+
+            // A torn line has no newline, it's dropped by the rewrite below
+            if (previous.eof()) {
+                break;
+            }
+            if (ss >> tag >> hex >> address && tag == "page") {
+                completed.insert(address);
+            }
+        }
+    }
+    previous.close();
+
+    // Rewrite the journal, so new records are never appended to a torn
+    // line. The new journal replaces the old one in one step
+    stringstream content;
+    content << header.str() << "\n";
+    for (auto address : completed) {
+        content << "page " << hex << address << "\n";
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    string tmp_filename = filename + ".tmp";
+    fd = ::open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        stringstream ss;
+        ss << "failed to open file " << tmp_filename;
+        throw ios_base::failure(ss.str());
+    }
+
+    if (!write_all(fd, content.str()) || fsync(fd) != 0 ||
+        rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        close(fd);
+        fd = -1;
+        remove(tmp_filename.c_str());
+        throw_write_error(filename);
+    }
+    sync_directory(filename);
+
+    return !completed.empty();
+}
+
+void FlashJournal::record(uint32_t address) {
+    stringstream line;
+
+    completed.insert(address);
+    line << "page " << hex << address << "\n";
+    if (fd < 0 || !write_all(fd, line.str())) {
+        throw_write_error(filename);
+    }
+}
+
+void FlashJournal::sync() {
+    if (fd < 0 || fsync(fd) != 0) {
+        throw_write_error(filename);
+    }
+}
+
+void FlashJournal::finish() {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    remove(filename.c_str());
+    completed.clear();
+}
+
+}  // namespace updi
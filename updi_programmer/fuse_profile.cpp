@@ -0,0 +1,127 @@
+#include "fuse_profile.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace updi {
+
+// Fuse names shared by tinyAVR 0/1, megaAVR 0 and AVR Dx series
+// APPEND/BOOTEND are called CODESIZE/BOOTSIZE on AVR Dx
+static const map<string, uint32_t> fuse_names = {
+    {"WDTCFG", 0x00},  {"BODCFG", 0x01},  {"OSCCFG", 0x02},
+    {"TCD0CFG", 0x04}, {"SYSCFG0", 0x05}, {"SYSCFG1", 0x06},
+    {"APPEND", 0x07},  {"CODESIZE", 0x07}, {"BOOTEND", 0x08},
+    {"BOOTSIZE", 0x08}};
+
+static string trim(const string& s) {
+    size_t first = s.find_first_not_of(" \t\r\n");
+    if (first == string::npos) {
+        return "";
+    }
+
+    size_t last = s.find_last_not_of(" \t\r\n");
+    return s.substr(first, last - first + 1);
+}
+
+FuseProfile::FuseProfile() {
+}
+
+FuseProfile::~FuseProfile() {
+}
+
+void FuseProfile::load_string(const string& list) {
+    stringstream ss(list);
+    string       entry;
+
+    while (getline(ss, entry, ',')) {
+        if (!trim(entry).empty()) {
+            parse_entry(entry);
+        }
+    }
+}
+
+void FuseProfile::load_file(const string& filename) {
+    ifstream file(filename.c_str());
+    string   line;
+    int      line_number = 0;
+
+    if (!file.is_open()) {
+        stringstream ss;
+        ss << "failed to open file " << filename;
+        throw ios_base::failure(ss.str());
+    }
+
+    while (getline(file, line)) {
+        line_number++;
+
+        size_t comment = line.find('#');
+        if (comment != string::npos) {
+            line.erase(comment);
+        }
+
+        if (trim(line).empty()) {
+            continue;
+        }
+
+        try {
+            parse_entry(line);
+        } catch (const invalid_argument& e) {
+            stringstream ss;
+            ss << filename << ":" << line_number << ": " << e.what();
+            throw ios_base::failure(ss.str());
+        }
+    }
+}
+
+const map<uint32_t, uint8_t>& FuseProfile::get_fuses() const {
+    return fuses;
+}
+
+void FuseProfile::parse_entry(const string& entry) {
+    size_t separator = entry.find('=');
+    if (separator == string::npos) {
+        throw invalid_argument("Fuse entry should be <fuse>=<value>: " + entry);
+    }
+
+    string name = trim(entry.substr(0, separator));
+    string value = trim(entry.substr(separator + 1));
+    transform(name.begin(), name.end(), name.begin(), ::toupper);
+
+    uint32_t fuse_num;
+    auto     it = fuse_names.find(name);
+    if (it != fuse_names.end()) {
+        fuse_num = it->second;
+    } else {
+        size_t pos = 0;
+        try {
+            fuse_num = stoul(name, &pos, 0);
+        } catch (const logic_error&) {
+            pos = 0;
+        }
+
+        if (name.empty() || pos != name.size()) {
+            throw invalid_argument("Unknown fuse " + name);
+        }
+    }
+
+    size_t        pos = 0;
+    unsigned long fuse_value = 0;
+    try {
+        fuse_value = stoul(value, &pos, 0);
+    } catch (const logic_error&) {
+        pos = 0;
+    }
+
+    if (value.empty() || pos != value.size() || fuse_value > 0xFF) {
+        throw invalid_argument("Invalid fuse value " + value);
+    }
+
+    fuses[fuse_num] = fuse_value;
+}
+
+}  // namespace updi
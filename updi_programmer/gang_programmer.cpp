@@ -0,0 +1,90 @@
+#include "gang_programmer.h"
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "updi_common.h"
+
+using namespace std;
+using namespace chrono;
+
+namespace updi {
+
+GangProgrammer::GangProgrammer(const vector<string>& ports,
+                               uint32_t              baud_rate,
+                               const string&         device_name)
+    : _ports(ports),
+      _baud_rate(baud_rate),
+      _device_name(device_name),
+      _retry_budget(-1),
+      _deadline_ms(0) {
+}
+
+GangProgrammer::~GangProgrammer() {
+}
+
+vector<GangResult> GangProgrammer::run(const ProgrammingJob& job) {
+    vector<GangResult> results(_ports.size());
+    vector<thread>     workers;
+
+    for (size_t i = 0; i < _ports.size(); i++) {
+        results[i].port = _ports[i];
+        workers.emplace_back(&GangProgrammer::program_unit, this, cref(job),
+                             ref(results[i]));
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    return results;
+}
+
+void GangProgrammer::program_unit(const ProgrammingJob& job,
+                                  GangResult&           result) {
+    auto start = steady_clock::now();
+
+    result.success = false;
+    result.report = {false, 0, 0};
+
+    try {
+        NvmProgrammer nvm(result.port, _baud_rate, _device_name);
+        if (_retry_budget >= 0) {
+            nvm.set_retry_budget(_retry_budget);
+        }
+        if (_deadline_ms) {
+            nvm.set_deadline(_deadline_ms);
+        }
+
+        nvm.get_device_info();
+        try {
+            nvm.enter_progmode();
+        } catch (const UpdiDeadlineException& e) {
+            throw;
+        } catch (const UpdiException& e) {
+            cerr << result.port << ": device is locked, unlock with chip erase"
+                 << endl;
+            nvm.unlock_device();
+        }
+
+        try {
+            result.report = job.run(nvm);
+            result.success = true;
+        } catch (const exception& e) {
+            result.error = e.what();
+        }
+
+        nvm.leave_progmode();
+    } catch (const exception& e) {
+        if (result.error.empty()) {
+            result.error = e.what();
+        }
+        result.success = false;
+    }
+
+    result.elapsed_ms =
+        duration_cast<milliseconds>(steady_clock::now() - start).count();
+}
+
+}  // namespace updi
@@ -0,0 +1,97 @@
+#ifndef __DATA_SAMPLER_H__
+#define __DATA_SAMPLER_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "nvm_programmer.h"
+
+namespace updi {
+
+/*
+ * @brief a data space location to sample, e.g., an SRAM variable or an ADC
+ * result register
+ */
+struct SampleChannel {
+    uint32_t address;
+    uint32_t size;
+};
+
+/*
+ * @brief The DataSampler class
+ *
+ * This class samples a list of data space locations over UPDI while the
+ * application keeps running, and streams timestamped samples as CSV lines.
+ *
+ * Channels close to each other are merged into one burst (pointer setup,
+ * REPEAT and LD with post-inc) when reading the gap in between is cheaper
+ * than starting a new burst, so every sample costs as few UPDI frames as
+ * possible.
+ */
+class DataSampler {
+   public:
+    DataSampler(NvmProgrammer& nvm, const std::vector<SampleChannel>& channels);
+    ~DataSampler();
+
+    /*
+     * @brief parse a channel list
+     *
+     * It may throw std::invalid_argument if the list is malformed.
+     *
+     * @param[in] list comma separated <address>[:<size>] entries (size up to
+     *                 8 bytes), e.g., "0x3800:2,0x0610:2,0x3F00"
+     * @return sample channels
+     */
+    static std::vector<SampleChannel> parse_channels(const std::string& list);
+
+    /*
+     * @brief sample all channels and write one CSV line per sample
+     *
+     * The first column is the time of the sample in us since the start.
+     * Multi-byte channels are little-endian values.
+     *
+     * It may throw @ref UpdiException if reading fails.
+     *
+     * @param[out] out stream to write the samples to
+     * @param[in] sample_count number of samples, 0 samples until @ref stop
+     */
+    void run(std::ostream& out, uint32_t sample_count);
+
+    /*
+     * @brief stop a running @ref run after the current sample
+     */
+    void stop() {
+        stopped = true;
+    }
+
+    /*
+     * @brief get the achieved sample rate of the last @ref run
+     *
+     * @return samples per second
+     */
+    double get_sample_rate() const {
+        return sample_rate;
+    }
+
+   private:
+    struct Burst {
+        uint32_t address;
+        uint32_t size;
+    };
+
+    void plan_bursts();
+
+    NvmProgrammer&             nvm_programmer;
+    std::vector<SampleChannel> sample_channels;
+    std::vector<Burst>         bursts;
+    std::atomic<bool>          stopped;
+    double                     sample_rate;
+};
+
+}  // namespace updi
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "updi_common.h"
+
+namespace updi {
+
+/*
+ * @brief The Deadline class
+ *
+ * A time budget for a whole job, shared by all programmer layers. Every
+ * layer limits its own waits (serial reads, NVM status polling) to the
+ * remaining budget, so a stuck unit is given up on when the budget is spent
+ * instead of after the sum of all worst case timeouts.
+ *
+ * The deadline is unlimited until @ref start is called. It's armed before
+ * an operation starts and only read while it runs.
+ */
+class Deadline {
+   public:
+    Deadline() : _limited(false) {
+    }
+
+    /*
+     * @brief arm the deadline
+     *
+     * @param[in] budget_ms time budget from now in ms
+     */
+    void start(uint32_t budget_ms) {
+        _limited = true;
+        _end = std::chrono::steady_clock::now() +
+               std::chrono::milliseconds(budget_ms);
+    }
+
+    /*
+     * @brief make the deadline unlimited again
+     */
+    void clear() {
+        _limited = false;
+    }
+
+    bool is_limited() const {
+        return _limited;
+    }
+
+    bool expired() const {
+        return _limited && std::chrono::steady_clock::now() >= _end;
+    }
+
+    /*
+     * @brief get the remaining budget
+     *
+     * @return remaining time in ms, UINT32_MAX if unlimited
+     */
+    uint32_t remaining_ms() const {
+        if (!_limited) {
+            return UINT32_MAX;
+        }
+
+        // Rounded up, so a wait limited to the budget ends past the deadline
+        auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+                             _end - std::chrono::steady_clock::now())
+                             .count();
+        return remaining > 0 ? (remaining + 999) / 1000 : 0;
+    }
+
+    /*
+     * @brief limit a wait to the remaining budget
+     *
+     * @param[in] timeout_ms the regular timeout of the wait
+     * @return timeout to use in ms
+     */
+    uint32_t limit(uint32_t timeout_ms) const {
+        return std::min(timeout_ms, remaining_ms());
+    }
+
+    /*
+     * @brief throw @ref UpdiDeadlineException if the budget is spent
+     */
+    void check() const {
+        if (expired()) {
+            throw UpdiDeadlineException();
+        }
+    }
+
+   private:
+    bool                                  _limited;
+    std::chrono::steady_clock::time_point _end;
+};
+
+}  // namespace updi
+
+#endif
@@ -14,6 +14,14 @@
 #define DEFAULT_SIGROW_ADDRESS 0x1100
 #define DEFAULT_FUSES_ADDRESS 0x1280
 #define DEFAULT_USERROW_ADDRESS 0x1300
+#define DEFAULT_EEPROM_ADDRESS 0x1400
+#define DEFAULT_FUSES_SIZE 11
+#define DEFAULT_FLASH_SECTION_BLOCK_SIZE 256
+#define DEFAULT_SERNUM_OFFSET 0x03
+#define DEFAULT_SERNUM_SIZE 10
+#define DEFAULT_CHIP_ERASE_MS 4
+#define DEFAULT_PAGE_ERASE_MS 2
+#define DEFAULT_PAGE_WRITE_MS 2
 
 namespace updi {
 // avr Dx series
@@ -58,15 +66,34 @@ class AvrDevice {
           nvmctrl_base_addr(DEFAULT_NVMCTRL_ADDRESS),
           sigrow_base_addr(DEFAULT_SIGROW_ADDRESS),
           fuses_base_addr(DEFAULT_FUSES_ADDRESS),
-          userrow_base_addr(DEFAULT_USERROW_ADDRESS) {
+          userrow_base_addr(DEFAULT_USERROW_ADDRESS),
+          eeprom_base_addr(DEFAULT_EEPROM_ADDRESS),
+          fuses_size(DEFAULT_FUSES_SIZE),
+          flash_section_block_size(DEFAULT_FLASH_SECTION_BLOCK_SIZE),
+          sernum_offset(DEFAULT_SERNUM_OFFSET),
+          sernum_size(DEFAULT_SERNUM_SIZE),
+          chip_erase_ms(DEFAULT_CHIP_ERASE_MS),
+          page_erase_ms(DEFAULT_PAGE_ERASE_MS),
+          page_write_ms(DEFAULT_PAGE_WRITE_MS) {
         lock_address = 0;
 
         if (avr_d_series.find(device_name) != avr_d_series.end()) {
             fuses_base_addr = 0x1050;
             userrow_base_addr = 0x1080;
+            fuses_size = 16;
+            flash_section_block_size = 512;
+            sernum_offset = 0x10;
+            sernum_size = 16;
+            // Flash is written word by word on AVR Dx
+            chip_erase_ms = 70;
+            page_erase_ms = 10;
+            page_write_ms = 9;
             lock_address = 0x1040;
             flash_start_addr = 0x800000;
             flash_page_size = 256;
+            eeprom_size = 512;
+            eeprom_page_size = 32;
+            userrow_size = 32;
 
             std::regex  r("\\d+");
             std::smatch sm;
@@ -77,40 +104,70 @@ class AvrDevice {
             flash_start_addr = 0x4000;
             flash_size = 48 * 1024;
             flash_page_size = 128;
+            eeprom_size = 256;
+            eeprom_page_size = 64;
+            userrow_size = 64;
         } else if (avr_mega_32k.find(device_name) != avr_mega_32k.end()) {
             flash_start_addr = 0x4000;
             flash_size = 32 * 1024;
             flash_page_size = 128;
+            eeprom_size = 256;
+            eeprom_page_size = 64;
+            userrow_size = 64;
         } else if (avr_mega_16k.find(device_name) != avr_mega_16k.end()) {
             flash_start_addr = 0x4000;
             flash_size = 16 * 1024;
             flash_page_size = 64;
+            eeprom_size = 256;
+            eeprom_page_size = 64;
+            userrow_size = 64;
         } else if (avr_mega_8k.find(device_name) != avr_mega_8k.end()) {
             flash_start_addr = 0x4000;
             flash_size = 8 * 1024;
             flash_page_size = 64;
+            eeprom_size = 256;
+            eeprom_page_size = 64;
+            userrow_size = 64;
         } else if (tiny_32k.find(device_name) != tiny_32k.end()) {
             flash_start_addr = 0x8000;
             flash_size = 32 * 1024;
             flash_page_size = 128;
+            eeprom_size = 256;
+            eeprom_page_size = 32;
+            userrow_size = 32;
         } else if (tiny_16k.find(device_name) != tiny_16k.end()) {
             flash_start_addr = 0x8000;
             flash_size = 16 * 1024;
             flash_page_size = 64;
+            eeprom_size = 256;
+            eeprom_page_size = 32;
+            userrow_size = 32;
         } else if (tiny_8k.find(device_name) != tiny_8k.end()) {
             flash_start_addr = 0x8000;
             flash_size = 8 * 1024;
             flash_page_size = 64;
+            eeprom_size = 128;
+            eeprom_page_size = 32;
+            userrow_size = 32;
         } else if (tiny_4k.find(device_name) != tiny_4k.end()) {
             flash_start_addr = 0x8000;
             flash_size = 4 * 1024;
             flash_page_size = 64;
+            eeprom_size = 128;
+            eeprom_page_size = 32;
+            userrow_size = 32;
         } else if (tiny_2k.find(device_name) != tiny_2k.end()) {
             flash_start_addr = 0x8000;
             flash_size = 2 * 1024;
             flash_page_size = 64;
+            eeprom_size = 64;
+            eeprom_page_size = 32;
+            userrow_size = 32;
         } else {
             /* Unsupported device*/
+            eeprom_size = 0;
+            eeprom_page_size = 0;
+            userrow_size = 0;
             std::cerr << "Unknown device" << std::endl;
         }
     }
@@ -118,6 +175,14 @@ class AvrDevice {
     ~AvrDevice() {
     }
 
+    /*
+     * @brief get the device model
+     * @return device name, e.g. tiny416
+     */
+    const std::string& get_name() {
+        return name;
+    }
+
     /*
      * @brief get the base address to read the revision ID
      * @return SYSCFG base address
@@ -142,6 +207,22 @@ class AvrDevice {
         return sigrow_base_addr;
     }
 
+    /*
+     * @brief get the address of the serial number in the Signature Row
+     * @return SERNUM0 address
+     */
+    uint32_t get_sernum_addr() {
+        return sigrow_base_addr + sernum_offset;
+    }
+
+    /*
+     * @brief get the length of the serial number
+     * @return number of SERNUM bytes
+     */
+    uint32_t get_sernum_size() {
+        return sernum_size;
+    }
+
     /*
      * @brief get the base address to Device-specific fuses
      * @return FUSES base address
@@ -150,6 +231,14 @@ class AvrDevice {
         return fuses_base_addr;
     }
 
+    /*
+     * @brief get the number of fuse bytes (including reserved ones)
+     * @return size of the FUSES memory
+     */
+    uint32_t get_fuses_size() {
+        return fuses_size;
+    }
+
     /*
      * @brief get the base address to User Row
      * @return USERROW base address
@@ -158,6 +247,38 @@ class AvrDevice {
         return userrow_base_addr;
     }
 
+    /*
+     * @brief get the size of the User Row
+     * @return USERROW size, one page
+     */
+    uint32_t get_userrow_size() {
+        return userrow_size;
+    }
+
+    /*
+     * @brief get the base address to EEPROM
+     * @return EEPROM base address
+     */
+    uint32_t get_eeprom_addr() {
+        return eeprom_base_addr;
+    }
+
+    /*
+     * @brief get the EEPROM size
+     * @return EEPROM size of the device
+     */
+    uint32_t get_eeprom_size() {
+        return eeprom_size;
+    }
+
+    /*
+     * @brief get the EEPROM page size, also used for the User Row
+     * @return EEPROM page buffer size
+     */
+    uint32_t get_eeprom_pagesize() {
+        return eeprom_page_size;
+    }
+
     /*
      * @brief get the lock address
      *        not apply to avr-tiny series
@@ -191,6 +312,31 @@ class AvrDevice {
         return flash_page_size;
     }
 
+    /*
+     * @brief get the block size of the BOOTEND/APPEND fuses
+     *        (BOOTSIZE/CODESIZE on AVR Dx)
+     * @return flash section granularity
+     */
+    uint32_t get_flash_section_blocksize() {
+        return flash_section_block_size;
+    }
+
+    /*
+     * @brief get the typical NVM timings, used to estimate programming time
+     * @return duration of a chip erase, page erase and page write in ms
+     */
+    uint32_t get_chip_erase_ms() {
+        return chip_erase_ms;
+    }
+
+    uint32_t get_page_erase_ms() {
+        return page_erase_ms;
+    }
+
+    uint32_t get_page_write_ms() {
+        return page_write_ms;
+    }
+
     /*
      * @brief get the supported device list
      * @return all supported device models
@@ -232,11 +378,22 @@ class AvrDevice {
     uint32_t    sigrow_base_addr;
     uint32_t    fuses_base_addr;
     uint32_t    userrow_base_addr;
+    uint32_t    eeprom_base_addr;
+    uint32_t    fuses_size;
 
     uint32_t lock_address;
     uint32_t flash_start_addr;
     uint32_t flash_size;
     uint32_t flash_page_size;
+    uint32_t flash_section_block_size;
+    uint32_t eeprom_size;
+    uint32_t eeprom_page_size;
+    uint32_t userrow_size;
+    uint32_t sernum_offset;
+    uint32_t sernum_size;
+    uint32_t chip_erase_ms;
+    uint32_t page_erase_ms;
+    uint32_t page_write_ms;
 };
 
 }  // namespace updi
@@ -0,0 +1,65 @@
+#ifndef __DEVICE_MANIFEST_H__
+#define __DEVICE_MANIFEST_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace updi {
+
+/*
+ * @brief one device model served by a station
+ */
+struct ManifestEntry {
+    uint32_t    signature;    // SIGROW DEVICEID0..2, e.g. 0x1E9421
+    std::string device_name;  // device profile, as for --device
+    std::string image_file;   // Intel HEX file
+    std::string fuse_file;    // fuse profile file, may be empty
+};
+
+/*
+ * @brief The DeviceManifest class
+ *
+ * This class is used for parsing a station manifest, which maps device
+ * signatures to the device profile, the image and the fuse profile to use.
+ *
+ * One entry per line ('#' starts a comment), relative paths are relative to
+ * the manifest:
+ *     0x1E9421  tiny1616  fw_tiny1616.hex  fuses_tiny1616.txt
+ *     0x1E9521  tiny3216  fw_tiny3216.hex
+ */
+class DeviceManifest {
+   public:
+    DeviceManifest();
+    ~DeviceManifest();
+
+    /*
+     * @brief parse a manifest file
+     *
+     * It may throw ios_base::failure if the file can't be opened, an entry
+     * is malformed or a signature is listed twice.
+     *
+     * @param[in] filename full path of the manifest
+     */
+    void load_file(const std::string& filename);
+
+    /*
+     * @brief find the entry of a device signature
+     *
+     * @param[in] signature device signature read from SIGROW
+     * @return matching entry, nullptr if the device is not served
+     */
+    const ManifestEntry* find(uint32_t signature) const;
+
+    const std::vector<ManifestEntry>& get_entries() const {
+        return entries;
+    }
+
+   private:
+    std::vector<ManifestEntry> entries;
+};
+
+}  // namespace updi
+
+#endif
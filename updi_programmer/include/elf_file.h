@@ -0,0 +1,110 @@
+#ifndef __ELF_FILE_H__
+#define __ELF_FILE_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "intel_hexfile.h"
+
+namespace updi {
+
+/*
+ * @brief The ElfFile class
+ *
+ * This class is used for loading an avr-gcc ELF file straight from the
+ * build, without converting it with avr-objcopy first.
+ *
+ * The loadable program headers are sorted into the memories by the load
+ * addresses of the avr-gcc linker scripts:
+ *     0x000000 flash (.text, .data initializers)
+ *     0x810000 EEPROM (.eeprom)
+ *     0x820000 fuses (.fuse)
+ *     0x850000 User Row (.user_signatures)
+ *
+ * Lock bits (.lock) and the device signature (.signature) are not written,
+ * the unit is locked by a separate step and the signature is read-only.
+ *
+ * The flash image is held by an @ref IntelHexFile, so it's split into pages
+ * like a hex file.
+ */
+class ElfFile {
+   public:
+    ElfFile(uint32_t flash_size, uint32_t page_size);
+    ~ElfFile();
+
+    /*
+     * @brief check if a file starts with the ELF magic number
+     *
+     * @param[in] filename full path of the file
+     * @return true for an ELF file, false if it's not or can't be read
+     */
+    static bool is_elf_file(const std::string& filename);
+
+    /*
+     * @brief load an ELF32 AVR executable
+     *
+     * The file is memory mapped and read in place.
+     *
+     * It throws ios_base::failure if the file can't be opened, isn't an
+     * ELF32 AVR file, or a segment is malformed or outside the memories.
+     *
+     * @param[in] filename full path of the ELF file, "-" for standard input
+     */
+    void load_file(const std::string& filename);
+
+    /*
+     * @brief load an ELF32 AVR executable from memory
+     *
+     * @param[in] data file content
+     * @param[in] size number of bytes in the buffer
+     * @param[in] name source name used in error messages
+     */
+    void load_buffer(const uint8_t*     data,
+                     size_t             size,
+                     const std::string& name = "<buffer>");
+
+    const IntelHexFile& get_flash() const {
+        return flash;
+    }
+
+    /*
+     * @brief get the EEPROM data
+     *
+     * @return data segments at EEPROM offsets, sorted by address
+     */
+    const std::vector<ImageSegment>& get_eeprom() const {
+        return eeprom;
+    }
+
+    /*
+     * @brief get the User Row data
+     *
+     * @return data segments at User Row offsets, sorted by address
+     */
+    const std::vector<ImageSegment>& get_user_row() const {
+        return user_row;
+    }
+
+    /*
+     * @brief get the fuse values
+     *
+     * @return fuse offset to fuse value map, as applied by
+     *         @ref NvmProgrammer::apply_fuse_profile
+     */
+    const std::map<uint32_t, uint8_t>& get_fuses() const {
+        return fuses;
+    }
+
+   private:
+    IntelHexFile                flash;
+    std::vector<ImageSegment>   eeprom;
+    std::vector<ImageSegment>   user_row;
+    std::map<uint32_t, uint8_t> fuses;
+};
+
+}  // namespace updi
+
+#endif
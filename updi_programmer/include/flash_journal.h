@@ -0,0 +1,106 @@
+#ifndef __FLASH_JOURNAL_H__
+#define __FLASH_JOURNAL_H__
+
+#include <stdint.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "intel_hexfile.h"
+
+namespace updi {
+
+/*
+ * @brief The FlashJournal class
+ *
+ * This class keeps an on-disk record of the flash pages which were written
+ * and verified, so an interrupted programming run can be resumed without
+ * chip erase from the first incomplete page.
+ *
+ * The journal is a text file, the first line identifies the image and the
+ * unit, every further line records one verified page:
+ *     image <image hash> device <signature and serial number>
+ *     page <page address>
+ *
+ * A journal of another image or another unit is discarded. A torn last line
+ * (e.g. after a power loss) is ignored. The header is replaced atomically and
+ * page records reach the disk with @ref sync.
+ */
+class FlashJournal {
+   public:
+    FlashJournal(const std::string& filename);
+    ~FlashJournal();
+
+    /*
+     * @brief calculate the hash identifying an image (64-bit FNV-1a over
+     * page addresses and data)
+     *
+     * @param[in] pages image pages
+     * @return image hash
+     */
+    static uint64_t image_hash(const std::vector<ProgramPage>& pages);
+
+    /*
+     * @brief open the journal for an image and a unit
+     *
+     * Completed pages are loaded if the journal matches the image and the
+     * unit, otherwise a new journal is started.
+     *
+     * It may throw ios_base::failure if the journal can't be written.
+     *
+     * @param[in] image_hash hash of the image to flash
+     * @param[in] device_id identity of the unit
+     *
+     * @return true if pages of a previous run can be resumed
+     */
+    bool open(uint64_t image_hash, const std::vector<uint8_t>& device_id);
+
+    /*
+     * @brief check if a page was written and verified already
+     *
+     * @param[in] address page address
+     */
+    bool is_completed(uint32_t address) const {
+        return completed.count(address) != 0;
+    }
+
+    /*
+     * @brief get the number of completed pages
+     */
+    size_t get_completed_count() const {
+        return completed.size();
+    }
+
+    /*
+     * @brief record a page as written and verified
+     *
+     * The record is only durable after the next @ref sync.
+     *
+     * It may throw ios_base::failure if the journal can't be written.
+     *
+     * @param[in] address page address
+     */
+    void record(uint32_t address);
+
+    /*
+     * @brief flush the recorded pages to the disk, e.g. after a batch
+     *
+     * It may throw ios_base::failure if the journal can't be written.
+     */
+    void sync();
+
+    /*
+     * @brief remove the journal after the run completed
+     */
+    void finish();
+
+   private:
+    std::string        filename;
+    std::set<uint32_t> completed;
+    int                fd;
+};
+
+}  // namespace updi
+
+#endif
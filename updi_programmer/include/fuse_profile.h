@@ -0,0 +1,66 @@
+#ifndef __FUSE_PROFILE_H__
+#define __FUSE_PROFILE_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+namespace updi {
+
+/*
+ * @brief The FuseProfile class
+ *
+ * This class is used for parsing a requested set of fuse values, either from
+ * a comma separated list (e.g., "WDTCFG=0x00,BODCFG=0x54,5=0xF6") or from a
+ * profile file with one "fuse = value" entry per line ('#' starts a comment).
+ *
+ * A fuse can be specified by its offset or by its name (WDTCFG, BODCFG,
+ * OSCCFG, TCD0CFG, SYSCFG0, SYSCFG1, APPEND/CODESIZE, BOOTEND/BOOTSIZE).
+ *
+ * The parsed profile will be applied by @ref NvmProgrammer.
+ */
+class FuseProfile {
+   public:
+    FuseProfile();
+    ~FuseProfile();
+
+    /*
+     * @brief parse a comma separated list of fuse entries
+     *
+     * It may throw std::invalid_argument if an entry is malformed.
+     *
+     * @param[in] list fuse entries e.g., "BODCFG=0x54,SYSCFG0=0xF6"
+     */
+    void load_string(const std::string& list);
+
+    /*
+     * @brief parse a fuse profile file
+     *
+     * It may throw ios_base::failure if the file can't be opened or an entry
+     * is malformed.
+     *
+     * @param[in] filename full path of the profile file
+     */
+    void load_file(const std::string& filename);
+
+    /*
+     * @brief get the requested fuse values
+     *
+     * @return fuse offset to fuse value map
+     */
+    const std::map<uint32_t, uint8_t>& get_fuses() const;
+
+    bool empty() const {
+        return fuses.empty();
+    }
+
+   private:
+    void parse_entry(const std::string& entry);
+
+    std::map<uint32_t, uint8_t> fuses;
+};
+
+}  // namespace updi
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef __GANG_PROGRAMMER_H__
+#define __GANG_PROGRAMMER_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "programming_job.h"
+
+namespace updi {
+
+/*
+ * @brief result of programming the unit on one port
+ */
+struct GangResult {
+    std::string port;
+    bool        success;
+    std::string error;
+    uint32_t    elapsed_ms;
+    JobReport   report;
+};
+
+/*
+ * @brief The GangProgrammer class
+ *
+ * This class runs one @ref ProgrammingJob on several ports concurrently.
+ * Every port gets its own worker thread and @ref NvmProgrammer session, while
+ * the parsed image of the job is shared.
+ *
+ * A failing port doesn't affect the others, results are reported per port.
+ */
+class GangProgrammer {
+   public:
+    GangProgrammer(const std::vector<std::string>& ports,
+                   uint32_t                        baud_rate,
+                   const std::string&              device_name);
+    ~GangProgrammer();
+
+    /*
+     * @brief set the retry budget of every session
+     *
+     * @param[in] retries see @ref NvmProgrammer::set_retry_budget
+     */
+    void set_retry_budget(uint32_t retries) {
+        _retry_budget = retries;
+    }
+
+    /*
+     * @brief set the time budget of every unit
+     *
+     * @param[in] budget_ms see @ref NvmProgrammer::set_deadline
+     */
+    void set_deadline(uint32_t budget_ms) {
+        _deadline_ms = budget_ms;
+    }
+
+    /*
+     * @brief program all ports and wait for every worker to finish
+     *
+     * @param[in] job recipe applied to every unit
+     * @return one result per port, in the order of the port list
+     */
+    std::vector<GangResult> run(const ProgrammingJob& job);
+
+   private:
+    void program_unit(const ProgrammingJob& job, GangResult& result);
+
+    std::vector<std::string> _ports;
+    uint32_t                 _baud_rate;
+    std::string              _device_name;
+    int                      _retry_budget;
+    uint32_t                 _deadline_ms;  // 0 means unlimited
+};
+
+}  // namespace updi
+
+#endif
@@ -3,17 +3,38 @@
 
 #include <stdint.h>
 
+#include <functional>
 #include <string>
 #include <vector>
 
 namespace updi {
 
+/*
+ * @brief a flash page, a view of pageSize bytes owned by the image or the
+ * caller which produced the page
+ */
 struct ProgramPage {
-    size_t               address;
-    size_t               pageSize;
+    size_t         address;
+    size_t         pageSize;
+    const uint8_t* data;
+};
+
+/*
+ * @brief contiguous firmware data, the address is a flash offset
+ */
+struct ImageSegment {
+    uint32_t             address;
     std::vector<uint8_t> data;
 };
 
+/*
+ * @brief called with every completed page of a streamed image, the page
+ * data is only valid during the call
+ *
+ * Returning false stops parsing.
+ */
+using PageReadyCallback = std::function<bool(const ProgramPage&)>;
+
 /*
  * @brief The IntelHexFile class
  *
@@ -21,45 +42,148 @@ struct ProgramPage {
  * arrange firmware data into pages (padding the data so it will align with page
  * size).
  *
+ * The image is held as sorted segments of contiguous data, so memory follows
+ * the firmware size and not the flash size. Pages are only generated where
+ * the image holds data, unused bytes of a page are padded with 0xFF.
+ *
+ * All pages live in a single buffer owned by this class, the page list only
+ * holds views into it. The object can't be copied so the views stay valid,
+ * share it through a pointer instead.
+ *
  * The splitted page data will be requested by @ref NvmProgrammer.
  * Note:
- *     Only record type 0 and 1 are supported.
+ *     Record types 00 to 05 are supported. Extended segment (02) and
+ *     extended linear (04) address records reach images beyond 64 KB, start
+ *     address records (03, 05) are ignored.
  */
 class IntelHexFile {
    public:
     IntelHexFile(uint32_t flash_size, uint32_t page_size);
     ~IntelHexFile();
 
+    IntelHexFile(const IntelHexFile&) = delete;
+    IntelHexFile& operator=(const IntelHexFile&) = delete;
+
     /*
      * @brief load Atmel studio generated hex file
      *
-     * @param[in] filename full path of the hex file
-     * @return flash start address
+     * The file is memory mapped and parsed in place. Pipes and other files
+     * which can't be mapped are read in one go first.
+     *
+     * It throws ios_base::failure if the file can't be opened or a record is
+     * malformed, the message holds the file, line and column of the error.
+     *
+     * @param[in] filename full path of the hex file, "-" for standard input
+     * @return flash offset of the first data byte
      */
     int load_file(const std::string& filename);
 
+    /*
+     * @brief load hex records from memory
+     *
+     * The buffer is parsed in place and not referenced afterwards.
+     *
+     * It throws ios_base::failure if a record is malformed.
+     *
+     * @param[in] data hex records, lines separated by LF or CRLF
+     * @param[in] size number of bytes in the buffer
+     * @param[in] name source name used in error messages
+     * @return flash offset of the first data byte
+     */
+    int load_buffer(const char*        data,
+                    size_t             size,
+                    const std::string& name = "<buffer>");
+
+    /*
+     * @brief parse hex records while they are read, every page is handed
+     * out as soon as its data is final
+     *
+     * Records have to be in ascending address order, as written by
+     * avr-objcopy, so all pages below the end of the latest record are
+     * final. Only the page being filled is held, the image is not kept and
+     * the page list stays empty.
+     *
+     * It throws ios_base::failure if the file can't be read, a record is
+     * malformed or goes back to a lower address.
+     *
+     * @param[in] filename full path of the hex file or pipe, "-" for
+     *                     standard input
+     * @param[in] page_ready called with every page, in address order
+     * @return flash offset of the first data byte
+     */
+    int load_stream(const std::string&       filename,
+                    const PageReadyCallback& page_ready);
+
+    /*
+     * @brief load several hex files into one image, e.g. bootloader,
+     * application and calibration data
+     *
+     * Files may overlap where their data is identical, the image holds
+     * it once.
+     *
+     * It throws ios_base::failure if a file can't be loaded or two files
+     * hold different data at the same address. Every conflicting address
+     * range is reported with both files.
+     *
+     * @param[in] filenames full paths of the hex files
+     * @return flash offset of the first data byte
+     */
+    int load_files(const std::vector<std::string>& filenames);
+
+    /*
+     * @brief load firmware data decoded from another file format
+     *
+     * The segments are sorted, merged and split into pages like hex records.
+     *
+     * It throws ios_base::failure if data exceeds the flash or is defined
+     * twice.
+     *
+     * @param[in] data segments at flash offsets, in any order
+     * @param[in] name source name used in error messages
+     * @return flash offset of the first data byte
+     */
+    int load_segments(std::vector<ImageSegment> data, const std::string& name);
+
     /*
      * @brief get the splitted and padded pages
      *
+     * Pages are sorted by address, there are gaps where the image holds no
+     * data. The page data is valid until the next load.
+     *
      * @return multiple page data for flashing
      */
-    const std::vector<ProgramPage>& get_page_data();
+    const std::vector<ProgramPage>& get_page_data() const;
 
     /*
      * @brief get the original binary data of the firmware
      *
-     * @return whole firmware data (without any padding)
+     * @return data segments sorted by address (without any padding)
      */
-    const std::vector<uint8_t>& get_flash_data();
+    const std::vector<ImageSegment>& get_segments() const;
 
    private:
-    int parse_record(const std::string& record, std::string& error);
+    int  parse_record(const char*  record,
+                      size_t       length,
+                      size_t&      error_column,
+                      std::string& error);
+    int  parse_line(const char*        record,
+                    size_t             length,
+                    int                line_number,
+                    const std::string& name);
+    int  build_pages(const std::string& name);
+    bool flush_pages(uint64_t                 end,
+                     uint32_t&                flushed_end,
+                     uint32_t&                page_count,
+                     const PageReadyCallback& page_ready);
+    void merge_segments(const std::string& name);
 
-    uint32_t                 nvm_flash_size;
-    uint32_t                 nvm_page_size;
-    uint32_t                 firmware_size;
-    std::vector<uint8_t>     nvm_data;
-    std::vector<ProgramPage> nvm_pages;
+    uint32_t                  nvm_flash_size;
+    uint32_t                  nvm_page_size;
+    uint32_t                  firmware_size;
+    uint32_t                  base_address;  // from address records
+    std::vector<ImageSegment> segments;
+    std::vector<uint8_t>      page_buffer;  // data of all pages
+    std::vector<ProgramPage>  nvm_pages;
 };
 
 }  // namespace updi
@@ -3,16 +3,95 @@
 
 #include <stdint.h>
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include "deadline.h"
 #include "device.h"
 #include "intel_hexfile.h"
 #include "updi_application.h"
+#include "updi_common.h"
 
 namespace updi {
 
+/*
+ * @brief statistics of recovered UPDI protocol errors
+ */
+struct RetryStatistics {
+    uint32_t retries;             // failed operations which were retried
+    uint32_t link_resyncs;        // successful link resynchronizations
+    uint32_t progmode_reentries;  // programming mode was lost and re-entered
+};
+
+/*
+ * @brief statistics of the session flash page cache
+ */
+struct CacheStatistics {
+    uint32_t hits;    // pages answered without link traffic
+    uint32_t misses;  // pages read from the target
+};
+
+/*
+ * @brief progress of a page based flash operation
+ */
+struct ProgressInfo {
+    uint32_t pages_done;
+    uint32_t pages_total;
+    double   bytes_per_second;
+    uint32_t eta_ms;
+};
+
+typedef std::function<void(const ProgressInfo&)> ProgressCallback;
+
+/*
+ * @brief cooperative cancellation of a page based operation
+ *
+ * Copies share the same state, so the caller keeps one copy and cancels
+ * while the operation checks it between pages.
+ */
+class CancellationToken {
+   public:
+    CancellationToken()
+        : _cancelled(std::make_shared<std::atomic<bool>>(false)) {
+    }
+
+    void cancel() {
+        *_cancelled = true;
+    }
+
+    bool is_cancelled() const {
+        return *_cancelled;
+    }
+
+   private:
+    std::shared_ptr<std::atomic<bool>> _cancelled;
+};
+
+/*
+ * @brief flash sections defined by the BOOTEND/APPEND fuses
+ */
+enum FlashSection {
+    FLASH_SECTION_BOOT,
+    FLASH_SECTION_APPCODE,
+    FLASH_SECTION_APPDATA
+};
+
+/*
+ * @brief a flash address range, relative to the flash start address
+ */
+struct FlashRange {
+    uint32_t offset;
+    uint32_t size;
+};
+
+class FlashExecutor;
+
 /*
  * @brief The NvmProgrammer class
  *
@@ -30,7 +109,27 @@ namespace updi {
  * - chip_erase
  * - write_flash
  * - read_flash
- * - leave_progmode
+ * - leave_progmode (or detach to keep the target in programming mode)
+ *
+ * write_flash and read_flash have variants which report progress through a
+ * callback (no per-page console output) and can be cancelled between pages.
+ * The asynchronous variants return at once, their page work is queued on one
+ * worker thread per NvmProgrammer and runs in submission order. Nothing else
+ * may be called on the NvmProgrammer until their futures are ready.
+ *
+ * Protocol errors during erase, page writes and page reads are recovered by
+ * resynchronizing the link and retrying only the failing operation, within
+ * the budget set by @ref set_retry_budget.
+ *
+ * A time budget set by @ref set_deadline is enforced by all layers down to
+ * the serial port, operations throw @ref UpdiDeadlineException once it is
+ * spent and no more retries are made.
+ *
+ * Flash pages read during a session are cached, so reading the same pages
+ * again (e.g. blank check, verify, final checksum) costs no link traffic.
+ * Writing or erasing a page drops it from the cache, so the next read after
+ * a write always goes to the target and verifies what was really written.
+ * The cache is cleared when programming mode is entered or left.
  */
 class NvmProgrammer {
    public:
@@ -49,6 +148,9 @@ class NvmProgrammer {
     /*
      * @brief enter programming mode
      *
+     * If the target was left in programming mode by a previous session (see
+     * @ref detach), the session is attached without key, reset and wait.
+     *
      * Note:
      *    It may throw @ref UpdiException if NVM fails to enter programming mode. 
      */
@@ -60,6 +162,41 @@ class NvmProgrammer {
      */
     void leave_progmode();
 
+    /*
+     * @brief end the session but keep the target in programming mode
+     *
+     * UPDI stays enabled so the next session can attach through
+     * @ref enter_progmode without the full handshake. The application is not
+     * running until @ref leave_progmode is called by a later session.
+     */
+    void detach();
+
+    /*
+     * @brief end the session without resetting the target
+     *
+     * UPDI is disabled, a running application is not disturbed.
+     */
+    void disconnect();
+
+    /*
+     * @brief check cheaply if the target is still attached and in
+     * programming mode
+     *
+     * @return true if the session can be used without bring-up
+     */
+    bool is_session_alive();
+
+    /*
+     * @brief check cheaply if a target is connected, without console output
+     *
+     * Meant for polling while waiting for a unit to be inserted or removed.
+     * The bring-up time of the next session is counted from the last
+     * successful probe.
+     *
+     * @return true if a target responds
+     */
+    bool probe_target();
+
     /*
      * @brief unlock device if @ref enter_progmode throws exception
      *
@@ -88,17 +225,189 @@ class NvmProgrammer {
      */
     std::vector<uint8_t> read_flash(uint32_t address, uint32_t size);
 
+    /*
+     * @brief read a number of bytes from the data space
+     *
+     * Unlike @ref read_flash, it doesn't require programming mode, so SRAM
+     * and peripheral registers can be read while the application runs.
+     *
+     * It may thrown exception @ref UpdiException if reading fails.
+     *
+     * @param[in] address data space address to read from
+     * @param[in] size number of bytes to read
+     *
+     * @return data read from the data space
+     */
+    std::vector<uint8_t> read_memory(uint32_t address, uint32_t size);
+
     /*
      * @brief write a number of pages from a base address
      *
+     * The first page is written at the base address, every further page at
+     * its distance to the first page, so pages may have gaps.
+     *
      * It may thrown exception @ref UpdiException if chip is not in programming
      * mode.
      * 
      * @param[in] address base offset to write to
+     * @param[in] pages pages of data to write, sorted by address
+     * @param[in] erase_pages erase each page before writing it, for flash
+     *                        which is not erased by @ref chip_erase
+     *
+     */
+    void write_flash(uint32_t                        address,
+                     const std::vector<ProgramPage>& pages,
+                     bool                            erase_pages = false);
+
+    /*
+     * @brief write a number of pages from a base address, reporting
+     * progress instead of console output
+     *
+     * It throws @ref UpdiException on failure, and
+     * @ref UpdiCancelledException if the operation was cancelled.
+     *
+     * @param[in] address base offset to write to
+     * @param[in] pages pages of data to write
+     * @param[in] progress called after every page, console output if null
+     * @param[in] cancel checked before every page
+     * @param[in] erase_pages erase each page before writing it
+     */
+    void write_flash(
+        uint32_t                        address,
+        const std::vector<ProgramPage>& pages,
+        const ProgressCallback&         progress,
+        const CancellationToken&        cancel = CancellationToken(),
+        bool                            erase_pages = false);
+
+    /*
+     * @brief read a number of pages from a base address, reporting progress
+     *
+     * It throws @ref UpdiException on failure, and
+     * @ref UpdiCancelledException if the operation was cancelled.
+     *
+     * @param[in] address start address to read from
+     * @param[in] size number of bytes to read (multiple of page sizes)
+     * @param[in] progress called after every page
+     * @param[in] cancel checked before every page
+     *
+     * @return data read from flash
+     */
+    std::vector<uint8_t> read_flash(
+        uint32_t                 address,
+        uint32_t                 size,
+        const ProgressCallback&  progress,
+        const CancellationToken& cancel = CancellationToken());
+
+    /*
+     * @brief queue writing a number of pages from a base address
+     *
+     * The pages are copied, the call returns without waiting for the link.
+     * The future rethrows @ref UpdiException on failure, and
+     * @ref UpdiCancelledException if the operation was cancelled.
+     *
+     * @param[in] address base offset to write to
      * @param[in] pages pages of data to write
+     * @param[in] progress called after every page (from the worker thread)
+     * @param[in] cancel checked before every page
+     * @param[in] erase_pages erase each page before writing it
+     *
+     * @return completion handle of the operation
+     */
+    std::future<void> write_flash_async(
+        uint32_t                        address,
+        const std::vector<ProgramPage>& pages,
+        const ProgressCallback&         progress,
+        const CancellationToken&        cancel = CancellationToken(),
+        bool                            erase_pages = false);
+
+    /*
+     * @brief queue reading a number of pages from a base address
+     *
+     * The future rethrows @ref UpdiException on failure, and
+     * @ref UpdiCancelledException if the operation was cancelled.
+     *
+     * @param[in] address start address to read from
+     * @param[in] size number of bytes to read (multiple of page sizes)
+     * @param[in] progress called after every page (from the worker thread)
+     * @param[in] cancel checked before every page
+     *
+     * @return completion handle with the data read from flash
+     */
+    std::future<std::vector<uint8_t>> read_flash_async(
+        uint32_t                 address,
+        uint32_t                 size,
+        const ProgressCallback&  progress,
+        const CancellationToken& cancel = CancellationToken());
+
+    /*
+     * @brief erase a number of pages from a base address
+     *
+     * It may thrown exception @ref UpdiException if chip is not in programming
+     * mode.
+     *
+     * @param[in] address base offset to erase from
+     * @param[in] size number of bytes to erase (multiple of page sizes)
+     */
+    void erase_flash(uint32_t address, uint32_t size);
+
+    /*
+     * @brief check if the whole flash is erased
+     *
+     * A few sampled pages are read first (the vector table page, the last
+     * page and every 16th page), so a programmed chip is rejected after a
+     * page or two. The remaining pages are only read to prove a blank chip.
+     *
+     * It may thrown exception @ref UpdiException if chip is not in programming
+     * mode.
+     *
+     * @return true if every flash byte is 0xFF
+     */
+    bool is_flash_blank();
+
+    /*
+     * @brief get the range of a flash section
+     *
+     * The section layout is read from the BOOTEND and APPEND fuses
+     * (BOOTSIZE and CODESIZE on AVR Dx).
+     *
+     * It may thrown exception @ref UpdiException if chip is not in programming
+     * mode.
+     *
+     * @param[in] section flash section
      *
+     * @return section range relative to the flash start (size 0 if the
+     * section doesn't exist)
      */
-    void write_flash(uint32_t address, const std::vector<ProgramPage>& pages);
+    FlashRange get_flash_section(FlashSection section);
+
+    /*
+     * @brief read the identity of the target
+     *
+     * It may thrown exception @ref UpdiException if reading fails.
+     *
+     * @return the 3 signature bytes followed by the serial number
+     */
+    std::vector<uint8_t> read_device_id();
+
+    /*
+     * @brief read the device signature from SIGROW
+     *
+     * It may thrown exception @ref UpdiException if reading fails, e.g. the
+     * device is locked.
+     *
+     * @return DEVICEID0..2 as one number, e.g. 0x1E9421
+     */
+    uint32_t read_signature();
+
+    /*
+     * @brief switch the session to another device profile
+     *
+     * The shared @ref AvrDevice is updated in place, so all layers use the
+     * memory map of the identified device.
+     *
+     * @param[in] device_name device model
+     */
+    void set_device(const std::string& device_name);
 
     /*
      * @brief read specified fuse value
@@ -146,6 +455,125 @@ class NvmProgrammer {
      */
     void write_fuse(uint32_t fuse_num, uint8_t value);
 
+    /*
+     * @brief read all fuses in one bulk read
+     *
+     * It may thrown exception @ref UpdiException if chip is not in programming
+     * mode.
+     *
+     * @return fuse values indexed by fuse offset
+     */
+    std::vector<uint8_t> read_fuses();
+
+    /*
+     * @brief apply a fuse profile within the current session
+     *
+     * All fuses are read in one go and compared with the requested profile.
+     * Only the fuses which differ are written, and they are read back
+     * afterwards for verification.
+     *
+     * It may thrown exception @ref UpdiException if chip is not in programming
+     * mode, a fuse offset is out of range or verification fails.
+     *
+     * @param[in] fuses fuse offset to fuse value map
+     *
+     * @return number of fuses written
+     */
+    uint32_t apply_fuse_profile(const std::map<uint32_t, uint8_t>& fuses);
+
+    /*
+     * @brief write data to the EEPROM within the current session
+     *
+     * The current content is read first, only pages holding different bytes
+     * are written, and the data is read back afterwards for verification.
+     * Bytes around the data are kept.
+     *
+     * It may thrown exception @ref UpdiException if chip is not in programming
+     * mode, the data exceeds the EEPROM or verification fails.
+     *
+     * @param[in] offset EEPROM offset of the first byte
+     * @param[in] data bytes to write
+     *
+     * @return number of pages written
+     */
+    uint32_t write_eeprom(uint32_t offset, const std::vector<uint8_t>& data);
+
+    /*
+     * @brief write data to the User Row within the current session, like
+     * @ref write_eeprom
+     *
+     * @param[in] offset User Row offset of the first byte
+     * @param[in] data bytes to write
+     *
+     * @return number of pages written
+     */
+    uint32_t write_user_row(uint32_t offset, const std::vector<uint8_t>& data);
+
+    /*
+     * @brief get the time from opening the port until programming mode was
+     * entered
+     *
+     * @return session bring-up time in ms, 0 if not in programming mode yet
+     */
+    uint32_t get_bringup_ms() const {
+        return _bringup_ms;
+    }
+
+    /*
+     * @brief set the number of retries allowed for a chip erase and for each
+     * page erased, written or read
+     *
+     * @param[in] retries retry budget, 0 disables recovery
+     */
+    void set_retry_budget(uint32_t retries) {
+        _retry_budget = retries;
+    }
+
+    /*
+     * @brief limit the time of the following operations
+     *
+     * Leaving programming mode, @ref detach and @ref disconnect clear the
+     * deadline, so the target is always released.
+     *
+     * @param[in] budget_ms time budget from now in ms
+     */
+    void set_deadline(uint32_t budget_ms) {
+        _deadline->start(budget_ms);
+    }
+
+    /*
+     * @brief remove the time limit
+     */
+    void clear_deadline() {
+        _deadline->clear();
+    }
+
+    /*
+     * @brief get the statistics of recovered protocol errors
+     *
+     * @return retry statistics of this session
+     */
+    const RetryStatistics& get_retry_stats() const {
+        return _retry_stats;
+    }
+
+    /*
+     * @brief get the statistics of the flash page cache
+     *
+     * @return cache statistics of this session
+     */
+    const CacheStatistics& get_cache_stats() const {
+        return _cache_stats;
+    }
+
+    /*
+     * @brief drop all cached flash pages, e.g. if the flash was changed
+     * outside of this session
+     */
+    void clear_page_cache() {
+        _page_cache.clear();
+    }
+
     /*
      * @brief get the shared @ref AvrDevice
      *
@@ -155,10 +583,61 @@ class NvmProgrammer {
         return _avr_device;
     }
 
+    uint32_t get_baud_rate() const {
+        return _baud_rate;
+    }
+
+   private:
+    void write_pages(uint32_t                        address,
+                     const std::vector<ProgramPage>& pages,
+                     bool                            erase_pages,
+                     const ProgressCallback&         progress,
+                     const CancellationToken&        cancel);
+    std::vector<uint8_t> read_pages(uint32_t                 address,
+                                    uint32_t                 size,
+                                    const ProgressCallback&  progress,
+                                    const CancellationToken& cancel);
+    uint32_t write_byte_pages(const std::string&          memory,
+                              uint32_t                    base_addr,
+                              uint32_t                    memory_size,
+                              uint32_t                    offset,
+                              const std::vector<uint8_t>& data);
+    bool recover_link(const UpdiException& error, uint32_t& retries_left);
+    void report_bringup();
+    FlashExecutor& executor();
+
+    uint32_t                                 _baud_rate;
+    std::shared_ptr<AvrDevice>               _avr_device;
+    std::shared_ptr<Deadline>                _deadline;
+    std::unique_ptr<UpdiApplication>         _updi_application;
+    bool                                     _programming;
+    uint32_t                                 _retry_budget;
+    RetryStatistics                          _retry_stats;
+    std::chrono::steady_clock::time_point    _session_start;
+    uint32_t                                 _bringup_ms;
+    std::map<uint32_t, std::vector<uint8_t>> _page_cache;  // by page address
+    CacheStatistics                          _cache_stats;
+    // last member, queued operations finish before the others are destroyed
+    std::unique_ptr<FlashExecutor>           _executor;
+};
+
+/*
+ * @brief clears the deadline of an @ref NvmProgrammer when leaving scope
+ *
+ * A job budget left armed limits every later link access to 0 ms, so the
+ * target couldn't even be probed any more once it is spent.
+ */
+class DeadlineGuard {
+   public:
+    explicit DeadlineGuard(NvmProgrammer& nvm) : _nvm(nvm) {
+    }
+
+    ~DeadlineGuard() {
+        _nvm.clear_deadline();
+    }
+
    private:
-    std::shared_ptr<AvrDevice>       _avr_device;
-    std::unique_ptr<UpdiApplication> _updi_application;
-    bool                             _programming;
+    NvmProgrammer& _nvm;
 };
 
 }  // namespace updi
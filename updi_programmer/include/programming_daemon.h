@@ -0,0 +1,113 @@
+#ifndef __PROGRAMMING_DAEMON_H__
+#define __PROGRAMMING_DAEMON_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "intel_hexfile.h"
+#include "nvm_programmer.h"
+
+namespace updi {
+
+/*
+ * @brief The ProgrammingDaemon class
+ *
+ * This class serves programming jobs over a Unix-domain socket and keeps a
+ * warm @ref NvmProgrammer session per port between jobs, so a job doesn't
+ * pay for process start, port open, double break and programming mode entry.
+ *
+ * A request is one line: a command followed by key=value arguments
+ *     flash  port=<tty> file=<hex> [blankcheck=1] [section=appcode]
+ *            [fuses=<profile>]
+ *     verify port=<tty> file=<hex>
+ *     fuses  port=<tty> fuses=<profile> | fusefile=<file>
+ *     dump   port=<tty> address=<addr> size=<bytes>
+ *     close  port=<tty>
+ *     ping
+ * device=<name> and baud=<rate> override the daemon defaults, timeout=<ms>
+ * limits the time of the job.
+ *
+ * Status is streamed back as lines: "progress <done>/<total> <B/s> <eta ms>",
+ * "data <hex bytes>", and finally "ok [details]" or "error <message>".
+ *
+ * Every client connection is served by its own thread, jobs on the same port
+ * are serialized. Idle sessions are health-checked periodically and dropped
+ * when the target is gone.
+ */
+class ProgrammingDaemon {
+   public:
+    ProgrammingDaemon(const std::string& socket_path,
+                      const std::string& device_name,
+                      uint32_t           baud_rate);
+    ~ProgrammingDaemon();
+
+    /*
+     * @brief serve requests until @ref stop is called
+     *
+     * It may throw std::runtime_error if the socket can't be set up.
+     */
+    void run();
+
+    /*
+     * @brief stop serving, can be called from a signal handler
+     */
+    void stop() {
+        _stopped = true;
+    }
+
+   private:
+    struct Session {
+        std::mutex                            lock;
+        std::unique_ptr<NvmProgrammer>        nvm;
+        std::string                           device_name;
+        uint32_t                              baud_rate;
+        std::chrono::steady_clock::time_point last_used;
+    };
+
+    typedef std::map<std::string, std::string> Arguments;
+
+    void serve_client(int client_fd);
+    void handle_request(int client_fd, const std::string& request);
+    void run_job(int                client_fd,
+                 const std::string& command,
+                 const Arguments&   args,
+                 Session&           session);
+    std::shared_ptr<Session> get_session(const std::string& port);
+    void open_session(Session&           session,
+                      const std::string& port,
+                      const std::string& device_name,
+                      uint32_t           baud_rate,
+                      bool               unlock);
+    std::shared_ptr<const IntelHexFile> load_image(const std::string& filename,
+                                                   AvrDevice&         device);
+    void check_idle_sessions();
+    void close_sessions();
+
+    std::string       _socket_path;
+    std::string       _device_name;
+    uint32_t          _baud_rate;
+    int               _server_fd;
+    std::atomic<bool> _stopped;
+    std::atomic<int>  _active_clients;
+
+    std::mutex                                      _sessions_lock;
+    std::map<std::string, std::shared_ptr<Session>> _sessions;
+
+    struct CachedImage {
+        std::shared_ptr<const IntelHexFile> image;
+        int64_t                             mtime;
+    };
+    std::mutex                         _images_lock;
+    std::map<std::string, CachedImage> _images;
+};
+
+}  // namespace updi
+
+#endif
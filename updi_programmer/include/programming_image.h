@@ -0,0 +1,130 @@
+#ifndef __PROGRAMMING_IMAGE_H__
+#define __PROGRAMMING_IMAGE_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "device.h"
+#include "intel_hexfile.h"
+
+namespace updi {
+
+/*
+ * @brief The ProgrammingImage class
+ *
+ * This class reads and writes precompiled programming images: a binary file
+ * holding everything a station needs, so nothing is parsed at startup.
+ *
+ * Layout, all values little endian:
+ *     header      magic, version, flash and page size, counts, device name
+ *     page table  flash offset and @ref ProgrammingPlan::page_hash per page
+ *     regions     EEPROM, User Row and fuse data
+ *     page data   all pages back to back, aligned to 4 KB
+ *
+ * The loaded file is memory mapped and the pages view the mapping. Every
+ * page is checked against its hash on load, the hashes then feed the
+ * programming plan directly.
+ */
+class ProgrammingImage {
+   public:
+    ProgrammingImage(uint32_t flash_size, uint32_t page_size);
+    ~ProgrammingImage();
+
+    ProgrammingImage(const ProgrammingImage&) = delete;
+    ProgrammingImage& operator=(const ProgrammingImage&) = delete;
+
+    /*
+     * @brief check if a file starts with the programming image magic number
+     *
+     * @param[in] filename full path of the file
+     * @return true for a programming image, false if it's not or can't be
+     *         read
+     */
+    static bool is_image_file(const std::string& filename);
+
+    /*
+     * @brief write a programming image
+     *
+     * It throws ios_base::failure if the file can't be written.
+     *
+     * @param[in] filename full path of the image file
+     * @param[in] device device the image is built for
+     * @param[in] flash flash image, split into pages of the device
+     * @param[in] eeprom data segments at EEPROM offsets
+     * @param[in] user_row data segments at User Row offsets
+     * @param[in] fuses fuse offset to fuse value map
+     */
+    static void write_file(const std::string&                 filename,
+                           AvrDevice&                         device,
+                           const IntelHexFile&                flash,
+                           const std::vector<ImageSegment>&   eeprom,
+                           const std::vector<ImageSegment>&   user_row,
+                           const std::map<uint32_t, uint8_t>& fuses);
+
+    /*
+     * @brief map a programming image
+     *
+     * It throws ios_base::failure if the file can't be opened, is not a
+     * programming image, doesn't match the flash geometry, is truncated or
+     * a page doesn't match its hash.
+     *
+     * @param[in] filename full path of the image file
+     */
+    void load_file(const std::string& filename);
+
+    const std::string& get_device_name() const {
+        return device_name;
+    }
+
+    /*
+     * @brief get the pages, viewing the mapped file
+     *
+     * @return pages sorted by address
+     */
+    const std::vector<ProgramPage>& get_page_data() const {
+        return pages;
+    }
+
+    /*
+     * @brief get the precomputed hash of every page
+     *
+     * @return @ref ProgrammingPlan::page_hash of the pages, in page order
+     */
+    const std::vector<uint64_t>& get_page_hashes() const {
+        return page_hashes;
+    }
+
+    const std::vector<ImageSegment>& get_eeprom() const {
+        return eeprom;
+    }
+
+    const std::vector<ImageSegment>& get_user_row() const {
+        return user_row;
+    }
+
+    const std::map<uint32_t, uint8_t>& get_fuses() const {
+        return fuses;
+    }
+
+   private:
+    void parse(const std::string& name);
+    void unmap();
+
+    uint32_t                    nvm_flash_size;
+    uint32_t                    nvm_page_size;
+    void*                       mapping;
+    size_t                      mapping_size;
+    std::string                 device_name;
+    std::vector<ProgramPage>    pages;
+    std::vector<uint64_t>       page_hashes;
+    std::vector<ImageSegment>   eeprom;
+    std::vector<ImageSegment>   user_row;
+    std::map<uint32_t, uint8_t> fuses;
+};
+
+}  // namespace updi
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef __PROGRAMMING_JOB_H__
+#define __PROGRAMMING_JOB_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include "flash_journal.h"
+#include "intel_hexfile.h"
+#include "nvm_programmer.h"
+#include "programming_image.h"
+#include "programming_plan.h"
+#include "unit_serializer.h"
+
+namespace updi {
+
+/*
+ * @brief outcome of one @ref ProgrammingJob run
+ */
+struct JobReport {
+    bool     erase_skipped;  // flash was proven blank, no chip erase
+    uint32_t pages_written;
+    uint32_t fuses_written;
+};
+
+/*
+ * @brief The ProgrammingJob class
+ *
+ * This class holds the recipe applied to every unit: erase, write and verify
+ * the firmware image, write the EEPROM and User Row data, then apply the fuse
+ * profile.
+ *
+ * The parsed image is shared read-only, so one job can be run on several
+ * @ref NvmProgrammer instances, also concurrently.
+ */
+class ProgrammingJob {
+   public:
+    ProgrammingJob();
+    ~ProgrammingJob();
+
+    /*
+     * @brief set the firmware image to flash
+     *
+     * Pages are written at their own flash offset.
+     *
+     * @param[in] image parsed firmware image
+     */
+    void set_image(const std::shared_ptr<const IntelHexFile>& image);
+
+    /*
+     * @brief set a precompiled firmware image to flash
+     *
+     * Its page hashes are used for planning instead of hashing the pages.
+     * The EEPROM, User Row and fuse data are set separately.
+     *
+     * @param[in] image mapped programming image
+     */
+    void set_image(const std::shared_ptr<const ProgrammingImage>& image);
+
+    /*
+     * @brief flash a hex file while it is still being parsed
+     *
+     * A parser thread hands every completed page to the programming thread
+     * through a bounded queue, so the first page is written before the file
+     * is complete and only a few pages are held. The records have to be in
+     * ascending address order, see @ref IntelHexFile::load_stream.
+     *
+     * Without the whole image there is no plan: the chip is erased, every
+     * non-blank page is written and verified against its hash at the end.
+     * A file can only be streamed once, sections, journals and unit data
+     * don't apply.
+     *
+     * @param[in] filename full path of the hex file or pipe, "-" for
+     *                     standard input
+     */
+    void set_stream(const std::string& filename) {
+        _stream = filename;
+    }
+
+    /*
+     * @brief only program one flash section instead of the whole chip
+     *
+     * @param[in] section flash section to erase, write and verify
+     */
+    void set_section(FlashSection section);
+
+    /*
+     * @brief skip the chip erase if the flash is proven blank
+     */
+    void set_blank_check(bool enable) {
+        _blank_check = enable;
+    }
+
+    /*
+     * @brief only verify the flash against the image, nothing is written
+     */
+    void set_verify_only(bool enable) {
+        _verify_only = enable;
+    }
+
+    /*
+     * @brief report page progress through a callback instead of console
+     * output
+     *
+     * @param[in] progress called after every page written or verified
+     */
+    void set_progress_callback(const ProgressCallback& progress) {
+        _progress = progress;
+    }
+
+    /*
+     * @brief record verified pages in a journal, so an interrupted run on
+     * the same unit resumes without chip erase
+     *
+     * Only applies to whole chip flashing, the journal is removed once the
+     * image is verified. Not combined with a serializer, every run patches
+     * new unit data and wouldn't match the journal.
+     *
+     * @param[in] filename full path of the journal file
+     */
+    void set_journal(const std::string& filename) {
+        _journal = filename;
+    }
+
+    /*
+     * @brief patch per-unit data into the image of every unit
+     *
+     * The serializer is shared, so concurrent runs get distinct unit data.
+     * Not applied to verify only jobs.
+     *
+     * @param[in] serializer source of the per-unit data
+     */
+    void set_serializer(const std::shared_ptr<UnitSerializer>& serializer) {
+        _serializer = serializer;
+    }
+
+    /*
+     * @brief set the data written to the EEPROM after flashing
+     *
+     * @param[in] segments data segments at EEPROM offsets
+     */
+    void set_eeprom(const std::vector<ImageSegment>& segments) {
+        _eeprom = segments;
+    }
+
+    /*
+     * @brief set the data written to the User Row after flashing
+     *
+     * @param[in] segments data segments at User Row offsets
+     */
+    void set_user_row(const std::vector<ImageSegment>& segments) {
+        _user_row = segments;
+    }
+
+    /*
+     * @brief set the fuse profile applied after flashing
+     *
+     * @param[in] fuses fuse offset to fuse value map
+     */
+    void set_fuse_profile(const std::map<uint32_t, uint8_t>& fuses) {
+        _fuses = fuses;
+    }
+
+    /*
+     * @brief plan flashing the image on a unit, nothing is sent to the unit
+     *
+     * Section flashing and journaled runs follow their own fixed steps, the
+     * plan covers whole chip flashing.
+     *
+     * @param[in] device device profile of the unit
+     * @param[in] baud_rate UPDI link baud rate
+     * @param[in] state flash offset to page hash map of the unit, see
+     *                  @ref ProgrammingPlan::set_device_state
+     * @return plan for the image of the job
+     */
+    ProgrammingPlan make_plan(AvrDevice&                          device,
+                              uint32_t                            baud_rate,
+                              const std::map<uint32_t, uint64_t>& state) const;
+
+    bool has_image() const {
+        return _pages != nullptr || !_stream.empty();
+    }
+
+    /*
+     * @brief run the job on a unit
+     *
+     * The unit has to be in programming mode already.
+     *
+     * It throws @ref UpdiException if any step fails, including verification.
+     *
+     * @param[in] nvm programmer connected to the unit
+     * @return job report
+     */
+    JobReport run(NvmProgrammer& nvm) const;
+
+   private:
+    void flash(NvmProgrammer&                  nvm,
+               const std::vector<ProgramPage>& pages,
+               JobReport&                      report) const;
+    void flash_stream(NvmProgrammer& nvm, JobReport& report) const;
+    void flash_section(NvmProgrammer&                  nvm,
+                       const std::vector<ProgramPage>& image_pages,
+                       JobReport&                      report) const;
+    void write_planned(NvmProgrammer&                  nvm,
+                       const std::vector<ProgramPage>& pages,
+                       const ProgrammingPlan&          plan) const;
+    void write_journaled(NvmProgrammer&                  nvm,
+                         const std::vector<ProgramPage>& pages,
+                         FlashJournal&                   journal,
+                         bool                            erase_pages) const;
+    void write_extra_pages(NvmProgrammer&                  nvm,
+                           const std::vector<ProgramPage>& pages) const;
+    void write_pages(NvmProgrammer&                  nvm,
+                     const std::vector<ProgramPage>& pages,
+                     bool                            erase_pages) const;
+    void verify_pages(NvmProgrammer&                  nvm,
+                      const std::vector<ProgramPage>& pages) const;
+    void verify_hashes(NvmProgrammer&                      nvm,
+                       const std::map<uint32_t, uint64_t>& page_hashes) const;
+    void write_byte_memories(NvmProgrammer& nvm) const;
+    void verify_byte_memories(NvmProgrammer& nvm) const;
+
+    std::shared_ptr<const std::vector<ProgramPage>> _pages;
+    std::shared_ptr<const std::vector<uint64_t>>    _page_hashes;
+    std::string                                     _stream;
+    bool                                            _use_section;
+    FlashSection                                    _section;
+    bool                                            _blank_check;
+    bool                                            _verify_only;
+    ProgressCallback                                _progress;
+    std::string                                     _journal;
+    std::shared_ptr<UnitSerializer>                 _serializer;
+    std::vector<ImageSegment>                       _eeprom;
+    std::vector<ImageSegment>                       _user_row;
+    std::map<uint32_t, uint8_t>                     _fuses;
+};
+
+}  // namespace updi
+
+#endif
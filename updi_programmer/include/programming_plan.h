@@ -0,0 +1,161 @@
+#ifndef __PROGRAMMING_PLAN_H__
+#define __PROGRAMMING_PLAN_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "device.h"
+#include "intel_hexfile.h"
+
+namespace updi {
+
+/*
+ * @brief how the flash is cleared before writing
+ */
+enum EraseStrategy {
+    ERASE_STRATEGY_CHIP,  // one chip erase, then plain page writes
+    ERASE_STRATEGY_PAGES  // erase-write only the pages that change
+};
+
+/*
+ * @brief estimated duration of every step of a plan in ms
+ */
+struct PlanEstimate {
+    uint32_t erase_ms;
+    uint32_t write_ms;
+    uint32_t verify_ms;
+    uint32_t total_ms;
+};
+
+/*
+ * @brief The ProgrammingPlan class
+ *
+ * This class decides how an image is put on a unit: chip erase or page
+ * erase-write, which pages can be skipped, and what has to be read back.
+ * The cheaper strategy is picked from a cost model of the UPDI link and the
+ * NVM timings of the device profile.
+ *
+ * The current flash content of the unit is optional. Without it every page
+ * is assumed to hold other data, so a chip erase is planned.
+ *
+ * Only written pages are read back for verification: a skipped page is
+ * either erased by the chip erase or known to match the image already.
+ */
+class ProgrammingPlan {
+   public:
+    ProgrammingPlan();
+    ~ProgrammingPlan();
+
+    /*
+     * @brief hash of a flash page, as used for the device state
+     */
+    static uint64_t page_hash(const uint8_t* data, size_t size);
+
+    /*
+     * @brief device state of a unit holding an image on otherwise erased
+     * flash
+     *
+     * @param[in] pages pages of the image on the unit
+     * @param[in] flash_size flash size of the device
+     * @param[in] page_size flash page size of the device
+     * @return flash offset to page hash map covering the whole flash
+     */
+    static std::map<uint32_t, uint64_t> image_state(
+        const std::vector<ProgramPage>& pages,
+        uint32_t                        flash_size,
+        uint32_t                        page_size);
+
+    /*
+     * @brief set the current flash content of the unit
+     *
+     * @param[in] page_hashes flash offset to @ref page_hash map, pages not
+     *                        listed are unknown
+     */
+    void set_device_state(const std::map<uint32_t, uint64_t>& page_hashes) {
+        _state = page_hashes;
+    }
+
+    /*
+     * @brief plan writing the image
+     *
+     * @param[in] device device profile
+     * @param[in] baud_rate UPDI link baud rate
+     * @param[in] pages image pages sorted by address
+     * @param[in] page_hashes precomputed @ref page_hash of every page, the
+     *                        pages are hashed if it's null
+     */
+    void build(AvrDevice&                      device,
+               uint32_t                        baud_rate,
+               const std::vector<ProgramPage>& pages,
+               const std::vector<uint64_t>*    page_hashes = nullptr);
+
+    EraseStrategy get_erase_strategy() const {
+        return _strategy;
+    }
+
+    /*
+     * @brief get the image pages to write, in address order
+     *
+     * @return indexes into the image pages
+     */
+    const std::vector<size_t>& get_write_pages() const {
+        return _write_pages;
+    }
+
+    /*
+     * @brief check if a page to write has to be erased first
+     *
+     * @param[in] index index into the image pages
+     */
+    bool needs_erase(size_t index) const;
+
+    /*
+     * @brief get the pages outside the image holding data, erased page by
+     * page with @ref ERASE_STRATEGY_PAGES
+     *
+     * @return flash offsets of the pages
+     */
+    const std::vector<uint32_t>& get_erase_pages() const {
+        return _erase_pages;
+    }
+
+    uint32_t get_skipped_count() const {
+        return _skipped;
+    }
+
+    const PlanEstimate& get_estimate() const {
+        return _estimate;
+    }
+
+    /*
+     * @brief print the plan and the estimate of both strategies
+     */
+    void print(std::ostream& os) const;
+
+   private:
+    enum PageAction {
+        PAGE_SKIP,
+        PAGE_WRITE,
+        PAGE_ERASE_WRITE
+    };
+
+    std::string                  _device_name;
+    uint32_t                     _baud_rate;
+    std::map<uint32_t, uint64_t> _state;
+    EraseStrategy                _strategy;
+    std::vector<PageAction>      _actions;
+    std::vector<size_t>          _write_pages;
+    std::vector<uint32_t>        _erase_pages;
+    uint32_t                     _skipped;
+    PlanEstimate                 _estimate;
+    PlanEstimate                 _chip_estimate;
+    PlanEstimate                 _pages_estimate;
+};
+
+}  // namespace updi
+
+#endif
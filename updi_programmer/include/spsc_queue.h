@@ -0,0 +1,146 @@
+#ifndef __SPSC_QUEUE_H__
+#define __SPSC_QUEUE_H__
+
+#include <stddef.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace updi {
+
+/*
+ * @brief The SpscQueue class
+ *
+ * A bounded lock-free queue between exactly one producer thread and one
+ * consumer thread.
+ *
+ * Items are swapped in and out of preallocated slots instead of being
+ * copied, so buffers held by the items circulate between both threads and
+ * nothing is allocated once every slot was used.
+ *
+ * The blocking calls wait by yielding and then sleeping, the wire on the
+ * other end is much slower than a wake-up.
+ */
+template <typename T>
+class SpscQueue {
+   public:
+    explicit SpscQueue(size_t capacity)
+        : _slots(capacity + 1),
+          _head(0),
+          _tail(0),
+          _closed(false),
+          _cancelled(false) {
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    /*
+     * @brief add an item, called by the producer only
+     *
+     * @param[in,out] item item to add, gets the content of a recycled slot
+     * @return false if the queue is full
+     */
+    bool try_push(T& item) {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        size_t next = (tail + 1) % _slots.size();
+
+        if (next == _head.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        std::swap(_slots[tail], item);
+        _tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    /*
+     * @brief remove the oldest item, called by the consumer only
+     *
+     * @param[in,out] item receives the item, its old content is recycled
+     * @return false if the queue is empty
+     */
+    bool try_pop(T& item) {
+        size_t head = _head.load(std::memory_order_relaxed);
+
+        if (head == _tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        std::swap(_slots[head], item);
+        _head.store((head + 1) % _slots.size(), std::memory_order_release);
+        return true;
+    }
+
+    /*
+     * @brief add an item, waiting while the queue is full
+     *
+     * @param[in,out] item item to add, gets the content of a recycled slot
+     * @return false if the consumer cancelled the queue
+     */
+    bool push(T& item) {
+        for (int attempt = 0; !_cancelled.load(); attempt++) {
+            if (try_push(item)) {
+                return true;
+            }
+            wait(attempt);
+        }
+        return false;
+    }
+
+    /*
+     * @brief remove the oldest item, waiting while the queue is empty
+     *
+     * @param[in,out] item receives the item, its old content is recycled
+     * @return false once the producer closed the queue and it ran empty
+     */
+    bool pop(T& item) {
+        for (int attempt = 0;; attempt++) {
+            // Items pushed before closing are still delivered
+            bool closed = _closed.load(std::memory_order_acquire);
+            if (try_pop(item)) {
+                return true;
+            }
+            if (closed) {
+                return false;
+            }
+            wait(attempt);
+        }
+    }
+
+    /*
+     * @brief no more items follow, called by the producer
+     */
+    void close() {
+        _closed.store(true, std::memory_order_release);
+    }
+
+    /*
+     * @brief stop the producer, called by the consumer
+     */
+    void cancel() {
+        _cancelled.store(true);
+    }
+
+   private:
+    static void wait(int attempt) {
+        if (attempt < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    std::vector<T>      _slots;  // one slot stays free to tell full from empty
+    std::atomic<size_t> _head;   // next slot to pop, written by the consumer
+    std::atomic<size_t> _tail;   // next slot to push, written by the producer
+    std::atomic<bool>   _closed;
+    std::atomic<bool>   _cancelled;
+};
+
+}  // namespace updi
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef __UNIT_SERIALIZER_H__
+#define __UNIT_SERIALIZER_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "intel_hexfile.h"
+
+namespace updi {
+
+/*
+ * @brief a per-unit data field in flash, the address is a flash offset as in
+ * the hex file
+ */
+struct SerialField {
+    uint32_t address;
+    uint32_t size;
+};
+
+/*
+ * @brief The UnitSerializer class
+ *
+ * This class generates the per-unit data (serial number, MAC, calibration
+ * constant, timestamp) patched into the image while flashing.
+ *
+ * Data sources:
+ * - a counter file holding the next serial number, stored little endian
+ * - a CSV file, the header lists the fields (e.g., "0x7F00:6,0x7F10:2") and
+ *   every further line holds the hex bytes of one unit (e.g.,
+ *   "0004A3112233,1F40"). The next line is kept in "<file>.next".
+ * - the programming time, stored as little endian Unix timestamp
+ *
+ * Unit data is consumed when it is allocated, so a failed unit leaves a gap
+ * instead of a duplicate. Allocation is thread safe.
+ */
+class UnitSerializer {
+   public:
+    UnitSerializer();
+    ~UnitSerializer();
+
+    /*
+     * @brief parse a field description "<address>:<size>"
+     *
+     * It may throw std::invalid_argument if the description is malformed.
+     */
+    static SerialField parse_field(const std::string& description);
+
+    /*
+     * @brief take serial numbers from a counter file
+     *
+     * It may throw ios_base::failure if the file can't be read.
+     *
+     * @param[in] filename counter file, holding the next serial number
+     * @param[in] field where the serial number is stored (up to 8 bytes)
+     */
+    void set_counter(const std::string& filename, const SerialField& field);
+
+    /*
+     * @brief take unit data from a CSV file
+     *
+     * It may throw ios_base::failure if the file can't be read or is
+     * malformed.
+     *
+     * @param[in] filename CSV file
+     */
+    void set_csv(const std::string& filename);
+
+    /*
+     * @brief store the programming time
+     *
+     * @param[in] field where the timestamp is stored (up to 8 bytes)
+     */
+    void set_timestamp(const SerialField& field);
+
+    bool empty() const {
+        return counter_file.empty() && csv_file.empty() && !use_timestamp;
+    }
+
+    /*
+     * @brief allocate the data of the next unit
+     *
+     * It may throw ios_base::failure if the data sources are exhausted or
+     * can't be updated.
+     *
+     * @return flash offset to byte value map
+     */
+    std::map<uint32_t, uint8_t> next_unit();
+
+    /*
+     * @brief patch unit data into the image pages
+     *
+     * The shared image stays untouched and is never parsed again. Only the
+     * affected pages are copied and patched, the other unit pages still view
+     * the image data. Data outside the image is put into extra pages padded
+     * with 0xFF.
+     *
+     * @param[in] pages shared image pages
+     * @param[in] data unit data from @ref next_unit
+     * @param[in] page_size flash page size
+     * @param[out] unit_pages image pages with the unit data
+     * @param[out] extra_pages pages outside the image holding unit data
+     * @param[out] page_data data of the patched and extra pages, it must
+     *                       outlive both page lists
+     */
+    static void patch_pages(const std::vector<ProgramPage>&    pages,
+                            const std::map<uint32_t, uint8_t>& data,
+                            uint32_t                           page_size,
+                            std::vector<ProgramPage>&          unit_pages,
+                            std::vector<ProgramPage>&          extra_pages,
+                            std::vector<uint8_t>&              page_data);
+
+   private:
+    std::string                           counter_file;
+    SerialField                           counter_field;
+    uint64_t                              counter;
+    std::string                           csv_file;
+    std::vector<SerialField>              csv_fields;
+    std::vector<std::vector<std::string>> csv_rows;
+    uint32_t                              csv_next;
+    bool                                  use_timestamp;
+    SerialField                           timestamp_field;
+    std::mutex                            lock;
+};
+
+}  // namespace updi
+
+#endif
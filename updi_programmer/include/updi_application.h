@@ -7,6 +7,7 @@
 #include <string>
 #include <vector>
 
+#include "deadline.h"
 #include "device.h"
 #include "updi_instruction_set.h"
 
@@ -18,12 +19,16 @@ namespace updi {
  * This class provides APIs for flashing, reading or easing the chip.
  * Basically, each API is a combination of UDPI instruction sets.
  * Interfaces will be invoked by @ref NvmProgrammer
+ *
+ * Status polling (programming mode, reset, unlock, flash ready) is limited
+ * to the remaining budget of the shared @ref Deadline.
  */
 class UpdiApplication {
    public:
     UpdiApplication(const std::string&                port,
                     uint32_t                          baud_rate,
-                    const std::shared_ptr<AvrDevice>& device);
+                    const std::shared_ptr<AvrDevice>& device,
+                    const std::shared_ptr<Deadline>&  deadline);
     ~UpdiApplication();
 
     /*
@@ -77,6 +82,13 @@ class UpdiApplication {
      */
     void leave_progmode();
 
+    /*
+     * @brief disable UPDI without resetting the chip
+     *
+     * The running application is not disturbed.
+     */
+    void disable_updi();
+
     /*
      * @brief apply or release an UPDI reset condition
      *
@@ -88,6 +100,24 @@ class UpdiApplication {
      */
     void reset(bool apply_reset);
 
+    /*
+     * @brief resynchronize the UPDI link after a protocol error
+     *
+     * Note:
+     *    It may throw @ref UpdiException if UPDI doesn't respond after a
+     * double break.
+     */
+    void resync_link();
+
+    /*
+     * @brief check quietly if a target is connected
+     *
+     * @return true if UPDI of a target responds
+     */
+    bool probe_target() {
+        return _updi_instruction->probe();
+    }
+
     /*
      * @brief erase chip
      *
@@ -104,10 +134,39 @@ class UpdiApplication {
      *
      * @param[in] start_addr NVM page start address
      * @param[in] page_data page data to be written
+     * @param[in] page_size number of bytes in the page
+     * @param[in] erase_page erase the page before writing it
+
+     */
+    void write_nvm_page(uint32_t       start_addr,
+                        const uint8_t* page_data,
+                        size_t         page_size,
+                        bool           erase_page = false);
+
+    /*
+     * @brief write a EEPROM or User Row page
+     *
+     * Only the bytes loaded into the page buffer are erased and written, the
+     * rest of the page is kept.
+     *
+     * Note:
+     *    It may throw @ref UpdiException if it fails to write page buffer.
+     *
+     * @param[in] start_addr data space address of the first byte
+     * @param[in] data bytes to write, all within one page
+     */
+    void write_eeprom_page(uint32_t                    start_addr,
+                           const std::vector<uint8_t>& data);
 
+    /*
+     * @brief erase a NVM page
+     *
+     * Note:
+     *    It may throw @ref UpdiException if it fails to erase the page.
+     *
+     * @param[in] start_addr NVM page start address
      */
-    void write_nvm_page(uint32_t                    start_addr,
-                        const std::vector<uint8_t>& page_data);
+    void erase_nvm_page(uint32_t start_addr);
 
     /*
      * @brief write a number of bytes to memory
@@ -128,8 +187,9 @@ class UpdiApplication {
      *
      * @param[in] start_addr location where data should be written
      * @param[in] data an byte array to write
+     * @param[in] size number of bytes to write
      */
-    void write_data_words(uint32_t address, const std::vector<uint8_t>& data);
+    void write_data_words(uint32_t address, const uint8_t* data, size_t size);
 
     /*
      * @brief read a number of bytes from UDPI
@@ -177,6 +237,33 @@ class UpdiApplication {
      */
     uint8_t read_fuse_data(uint32_t fuse_number);
 
+    /*
+     * @brief get the time spent to bring up the UPDI link
+     *
+     * @return bring-up time in ms
+     */
+    uint32_t get_link_bringup_ms() const {
+        return _updi_instruction->get_bringup_ms();
+    }
+
+    /*
+     * @brief check if the link bring-up needed a double break
+     *
+     * @return true if the 300 baud double break was sent
+     */
+    bool link_needed_double_break() const {
+        return _updi_instruction->double_break_used();
+    }
+
+    /*
+     * @brief suppress the per-page step output
+     *
+     * Used while progress is reported through a callback instead.
+     *
+     * @param[in] quiet true to suppress the output
+     */
+    void set_quiet(bool quiet) { _quiet = quiet; }
+
    private:
     bool wait_unlocked(uint32_t timeout_ms);
     void write_progmode_key();
@@ -185,7 +272,9 @@ class UpdiApplication {
 
     std::unique_ptr<UpdiInstruction> _updi_instruction;
     std::shared_ptr<AvrDevice>       _avr_device;
+    std::shared_ptr<Deadline>        _deadline;
     bool                             _pdi_v2;
+    bool                             _quiet;
 };
 
 }  // namespace updi
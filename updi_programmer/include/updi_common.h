@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include <exception>
+#include <stdexcept>
 #include <string>
 
 namespace updi {
@@ -126,6 +127,22 @@ struct UpdiException : public std::runtime_error {
     UpdiException(const std::string& message) : std::runtime_error(message) {
     }
 };
+
+/**
+ * @brief An Exception type thrown when an operation is cancelled
+ */
+struct UpdiCancelledException : public UpdiException {
+    UpdiCancelledException() : UpdiException("Operation cancelled") {
+    }
+};
+
+/**
+ * @brief An Exception type thrown when the time budget of a job is spent
+ */
+struct UpdiDeadlineException : public UpdiException {
+    UpdiDeadlineException() : UpdiException("Deadline exceeded") {
+    }
+};
 }  // namespace updi
 
 #endif
\ No newline at end of file
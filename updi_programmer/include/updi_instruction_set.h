@@ -19,7 +19,9 @@ namespace updi {
  */
 class UpdiInstruction {
    public:
-    UpdiInstruction(const std::string& port, uint32_t baud_rate);
+    UpdiInstruction(const std::string&               port,
+                    uint32_t                         baud_rate,
+                    const std::shared_ptr<Deadline>& deadline);
     ~UpdiInstruction();
 
     /*
@@ -117,9 +119,10 @@ class UpdiInstruction {
      * @brief store a number of words to the pointer location with pointer
      * post-inc
      *
-     * @param[in] data byte array to store
+     * @param[in] data bytes to store
+     * @param[in] size number of bytes, a multiple of 2
      */
-    void st_ptr_inc16(const std::vector<uint8_t>& data);
+    void st_ptr_inc16(const uint8_t* data, size_t size);
 
     /*
      * @brief store a value to the repeat counter
@@ -163,11 +166,52 @@ class UpdiInstruction {
      */
     bool updi_is_ready();
 
+    /*
+     * @brief resynchronize the UPDI link after a protocol error
+     *
+     * A double break is sent to reset the UPDI state machine, and the PHY
+     * configuration is restored afterwards. NVM keys and programming mode
+     * are not affected by a double break.
+     *
+     * @return true if UPDI responds again; Otherwise, false
+     */
+    bool resync();
+
+    /*
+     * @brief check quietly if a target is connected
+     *
+     * A normal break wakes up UPDI and the status register is read with a
+     * short timeout, so polling for a target is cheap.
+     *
+     * @return true if UPDI responds; Otherwise, false
+     */
+    bool probe();
+
+    /*
+     * @brief get the time spent to bring up the UPDI link
+     *
+     * @return bring-up time in ms
+     */
+    uint32_t get_bringup_ms() const {
+        return _bringup_ms;
+    }
+
+    /*
+     * @brief check if bring-up needed the 300 baud double break
+     *
+     * @return true if the fast path with a normal break failed
+     */
+    bool double_break_used() const {
+        return _double_break_used;
+    }
+
    private:
     void init();
 
     std::unique_ptr<UpdiSerial> _serial_comm;
     bool                        _use_24bit_addr;
+    uint32_t                    _bringup_ms;
+    bool                        _double_break_used;
 };
 
 }  // namespace updi
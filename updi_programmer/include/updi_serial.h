@@ -4,9 +4,12 @@
 #include <stdint.h>
 
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "deadline.h"
+
 namespace updi {
 
 /*
@@ -15,10 +18,15 @@ namespace updi {
  * This class is implementing low level physical UART communication.
  * High level applications can adopt this class to send/receive data.
  * Interfaces will be invoked by @ref UpdiInstruction
+ *
+ * Reads wait for the transfer time of the expected bytes at the line speed
+ * plus the read timeout, limited by the shared @ref Deadline.
  */
 class UpdiSerial {
    public:
-    UpdiSerial(const std::string& port, uint32_t baud_rate);
+    UpdiSerial(const std::string&               port,
+               uint32_t                         baud_rate,
+               const std::shared_ptr<Deadline>& deadline);
     ~UpdiSerial();
 
     /*
@@ -28,9 +36,20 @@ class UpdiSerial {
      */
     void send(const std::vector<uint8_t>& command);
 
+    /*
+     * @brief send bytes to the MCU without copying them into a command
+     *
+     * @param[in] data bytes to send out
+     * @param[in] size number of bytes
+     */
+    void send(const uint8_t* data, size_t size);
+
     /*
      * @brief receive an array of bytes from the MCU
      *
+     * It may throw @ref UpdiDeadlineException if the deadline expires while
+     * waiting.
+     *
      * @param[out] data byte array to store received data
      * @param[in] expected_size total number of bytes to receive
      */
@@ -44,12 +63,43 @@ class UpdiSerial {
      */
     void send_double_break();
 
+    /*
+     * @brief send a single break at the configured baud rate
+     *
+     * This is enough to wake up an idle UDPI or recover a UPDI which is
+     * enabled already, and is much faster than @ref send_double_break.
+     */
+    void send_break();
+
+    /*
+     * @brief set how long @ref receive waits beyond the transfer time
+     *
+     * @param[in] timeout_ms timeout in ms
+     */
+    void set_read_timeout(uint32_t timeout_ms);
+
+    /*
+     * @brief suppress the timeout report of @ref receive, e.g. while polling
+     * for a target which may not be connected
+     *
+     * @param[in] quiet true to suppress the report
+     */
+    void set_quiet_timeouts(bool quiet) {
+        _quiet_timeouts = quiet;
+    }
+
    private:
-    bool init_serial_comm(uint32_t baud);
+    bool     init_serial_comm(uint32_t baud);
+    uint32_t read_bytes(uint8_t* data, uint32_t size, uint32_t timeout_ms);
+    uint32_t transfer_ms(uint32_t size) const;
 
-    std::string _serial_port;
-    uint32_t    _baud_rate;
-    int         _serial_fd;
+    std::string               _serial_port;
+    uint32_t                  _baud_rate;
+    uint32_t                  _line_baud;
+    int                       _serial_fd;
+    uint32_t                  _read_timeout_ms;
+    bool                      _quiet_timeouts;
+    std::shared_ptr<Deadline> _deadline;
 };
 
 }  // namespace updi
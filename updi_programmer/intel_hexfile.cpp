@@ -1,152 +1,682 @@
 #include "intel_hexfile.h"
 
-#include <fstream>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
 
-#include <string.h>
-
 using namespace std;
 
 namespace updi {
 
-static uint64_t asciiHexTo64(string s) {
-    stringstream o;
-    o << hex << s;
-    uint64_t v;
-    o >> v;
-    return v;
+// Record layout: ':' count(2) address(4) type(2) data(2 * count) checksum(2)
+constexpr size_t RECORD_HEADER_SIZE = 9;
+constexpr size_t RECORD_MIN_SIZE = RECORD_HEADER_SIZE + 2;
+
+constexpr int RECORD_DATA = 0x00;
+constexpr int RECORD_END_OF_FILE = 0x01;
+constexpr int RECORD_EXTENDED_SEGMENT_ADDRESS = 0x02;
+constexpr int RECORD_START_SEGMENT_ADDRESS = 0x03;
+constexpr int RECORD_EXTENDED_LINEAR_ADDRESS = 0x04;
+constexpr int RECORD_START_LINEAR_ADDRESS = 0x05;
+
+// Nibble value of every character, -1 if it's not a hex digit
+struct HexTable {
+    int8_t value[256];
+
+    constexpr HexTable() : value() {
+        for (int c = 0; c < 256; c++) {
+            value[c] = (c >= '0' && c <= '9')   ? c - '0'
+                       : (c >= 'A' && c <= 'F') ? c - 'A' + 10
+                       : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                                                : -1;
+        }
+    }
+};
+
+static constexpr HexTable HEX_TABLE;
+
+// Decode the hex byte at record[pos], -1 if it's malformed
+static int decode_byte(const char* record, size_t pos) {
+    int high = HEX_TABLE.value[(uint8_t)record[pos]];
+    int low = HEX_TABLE.value[(uint8_t)record[pos + 1]];
+    return (high | low) < 0 ? -1 : (high << 4) | low;
 }
 
 IntelHexFile::IntelHexFile(uint32_t flash_size, uint32_t page_size)
-    : nvm_flash_size(flash_size), nvm_page_size(page_size) {
-    nvm_data.resize(nvm_flash_size);
+    : nvm_flash_size(flash_size),
+      nvm_page_size(page_size),
+      firmware_size(0),
+      base_address(0) {
 }
 
 IntelHexFile::~IntelHexFile() {
 }
 
+// Read everything from a descriptor mmap can't map, e.g. a pipe
+static bool read_all(int fd, string& content) {
+    char buffer[65536];
+
+    while (true) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        content.append(buffer, n);
+    }
+}
+
 int IntelHexFile::load_file(const string& filename) {
-    char     rec_line[524] = {0};
-    string   parse_error;
-    ifstream file(filename.c_str());
-    int      start_address = 0x7fffffff;
+    string content;
 
-    if (!file.is_open()) {
+    if (filename == "-") {
+        if (!read_all(STDIN_FILENO, content)) {
+            throw ios_base::failure("failed to read standard input");
+        }
+        return load_buffer(content.data(), content.size(), "<stdin>");
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
         stringstream ss;
         ss << "failed to open file " << filename;
         throw ios_base::failure(ss.str());
     }
 
+    // Regular files are parsed straight from the page cache
+    struct stat st;
+    void*       mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    if (mapping == MAP_FAILED) {
+        bool success = read_all(fd, content);
+        close(fd);
+        if (!success) {
+            stringstream ss;
+            ss << "failed to read file " << filename;
+            throw ios_base::failure(ss.str());
+        }
+        return load_buffer(content.data(), content.size(), filename);
+    }
+
+    close(fd);
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+    int start_address;
+    try {
+        start_address =
+            load_buffer((const char*)mapping, st.st_size, filename);
+    } catch (...) {
+        munmap(mapping, st.st_size);
+        throw;
+    }
+
+    munmap(mapping, st.st_size);
+    return start_address;
+}
+
+int IntelHexFile::load_buffer(const char*   data,
+                              size_t        size,
+                              const string& name) {
+    int line_number = 0;
+
     firmware_size = 0;
+    base_address = 0;
+    segments.clear();
+    page_buffer.clear();
+    nvm_pages.clear();
 
-    while (true) {
-        file.getline(rec_line, 524);
-        string record = rec_line;
+    const char* line = data;
+    const char* end = data + size;
+    while (line < end) {
+        const char* line_end = (const char*)memchr(line, '\n', end - line);
+        if (!line_end) {
+            line_end = end;
+        }
 
-        /*
-         * End of file
-         */
-        if (!file || record.empty()) {
+        const char* record = line;
+        size_t      length = line_end - line;
+        line = line_end + 1;
+        line_number++;
+
+        // Nothing follows the end of file record
+        int record_type = parse_line(record, length, line_number, name);
+        if (record_type == RECORD_END_OF_FILE) {
             break;
         }
+    }
+
+    return build_pages(name);
+}
+
+int IntelHexFile::load_stream(const string&            filename,
+                              const PageReadyCallback& page_ready) {
+    bool   from_stdin = filename == "-";
+    string name = from_stdin ? "<stdin>" : filename;
+    int    fd = from_stdin ? STDIN_FILENO : open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        stringstream ss;
+        ss << "failed to open file " << filename;
+        throw ios_base::failure(ss.str());
+    }
+
+    firmware_size = 0;
+    base_address = 0;
+    segments.clear();
+    page_buffer.clear();
+    nvm_pages.clear();
+
+    string   pending;
+    char     buffer[4096];
+    int      line_number = 0;
+    int      start_address = -1;
+    uint32_t flushed_end = 0;
+    uint32_t page_count = 0;
+    bool     finished = false;
+    bool     stopped = false;
+
+    try {
+        while (!finished && !stopped) {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                stringstream ss;
+                ss << "failed to read file " << name;
+                throw ios_base::failure(ss.str());
+            }
+            pending.append(buffer, n);
+
+            // Only complete lines are parsed, the last line may lack its LF
+            size_t line = 0;
+            while (!finished && !stopped) {
+                size_t line_end = pending.find('\n', line);
+                if (line_end == string::npos) {
+                    if (n > 0 || line >= pending.size()) {
+                        break;
+                    }
+                    line_end = pending.size();
+                }
+
+                int record_type = parse_line(&pending[line], line_end - line,
+                                             ++line_number, name);
+                line = line_end + 1;
+
+                if (record_type == RECORD_END_OF_FILE) {
+                    finished = true;
+                } else if (record_type == RECORD_DATA && !segments.empty()) {
+                    auto& last = segments.back();
+                    bool  behind = last.address < flushed_end;
+                    if (segments.size() > 1) {
+                        auto& previous = segments[segments.size() - 2];
+                        behind |= last.address <
+                                  previous.address + previous.data.size();
+                    }
+                    if (behind) {
+                        stringstream ss;
+                        ss << name << ":" << line_number << ": data at 0x"
+                           << hex << last.address
+                           << " is out of order, streaming needs records in "
+                              "ascending address order";
+                        cerr << ss.str() << endl;
+                        throw ios_base::failure(ss.str());
+                    }
+                    if (start_address < 0) {
+                        start_address = last.address;
+                    }
+
+                    // Later records start at or beyond the end of this one,
+                    // so all pages below it are final
+                    uint32_t data_end = last.address + last.data.size();
+                    stopped = !flush_pages(data_end - data_end % nvm_page_size,
+                                           flushed_end, page_count,
+                                           page_ready);
+                }
+            }
+            pending.erase(0, min(line, pending.size()));
+
+            if (n == 0) {
+                finished = true;
+            }
+        }
+
+        if (!stopped) {
+            flush_pages(UINT64_MAX, flushed_end, page_count, page_ready);
+        }
+    } catch (...) {
+        if (!from_stdin) {
+            close(fd);
+        }
+        throw;
+    }
+
+    if (!from_stdin) {
+        close(fd);
+    }
+
+    cout << "total size " << firmware_size << ", " << page_count
+         << " pages streamed" << endl;
+    return start_address < 0 ? 0 : start_address;
+}
+
+int IntelHexFile::load_files(const vector<string>& filenames) {
+    // Segment of one of the files, each file is free of overlaps itself
+    struct SourceSegment {
+        const ImageSegment* segment;
+        const string*       name;
+    };
+
+    vector<unique_ptr<IntelHexFile>> parts;
+    vector<SourceSegment>            sources;
+    string                           name;
+
+    for (auto& filename : filenames) {
+        parts.push_back(
+            make_unique<IntelHexFile>(nvm_flash_size, nvm_page_size));
+        parts.back()->load_file(filename);
+        for (auto& segment : parts.back()->get_segments()) {
+            sources.push_back(SourceSegment{&segment, &filename});
+        }
+        name += (name.empty() ? "" : "+") + filename;
+    }
+
+    stable_sort(sources.begin(), sources.end(),
+                [](const SourceSegment& a, const SourceSegment& b) {
+                    return a.segment->address < b.segment->address;
+                });
+
+    // Overlapping data of two files has to match byte by byte, every run of
+    // differing bytes is a conflict
+    vector<string> conflicts;
+    for (size_t i = 0; i < sources.size(); i++) {
+        auto&    a = *sources[i].segment;
+        uint32_t a_end = a.address + a.data.size();
+
+        for (size_t j = i + 1;
+             j < sources.size() && sources[j].segment->address < a_end; j++) {
+            auto&    b = *sources[j].segment;
+            uint32_t end = min<uint32_t>(a_end, b.address + b.data.size());
+
+            for (uint32_t address = b.address; address < end;) {
+                if (a.data[address - a.address] ==
+                    b.data[address - b.address]) {
+                    address++;
+                    continue;
+                }
+
+                uint32_t first = address;
+                while (address < end && a.data[address - a.address] !=
+                                            b.data[address - b.address]) {
+                    address++;
+                }
+
+                stringstream ss;
+                ss << *sources[j].name << ": data at 0x" << hex << first
+                   << "-0x" << address - 1 << " conflicts with "
+                   << *sources[i].name;
+                cerr << ss.str() << endl;
+                conflicts.push_back(ss.str());
+            }
+        }
+    }
+
+    if (!conflicts.empty()) {
+        stringstream ss;
+        ss << conflicts.front();
+        if (conflicts.size() > 1) {
+            ss << " (" << conflicts.size() << " conflicting ranges)";
+        }
+        throw ios_base::failure(ss.str());
+    }
 
-        // For AVR tiny series, we only support record type 0 and 1.
-        // x86 related record types will not be handled here
-        int rec_start = parse_record(record, parse_error);
-        if (rec_start < 0) {
-            cerr << parse_error << endl;
-            throw ios_base::failure(parse_error);
+    // Matching overlaps are only taken once
+    vector<ImageSegment> merged;
+    for (auto& source : sources) {
+        auto& segment = *source.segment;
+        if (merged.empty() ||
+            segment.address >
+                merged.back().address + merged.back().data.size()) {
+            merged.push_back(segment);
+            continue;
         }
 
-        // Normally, first record should contain the start address.
-        // This is just in case records are not organized in order
-        if (rec_start < start_address) {
-            start_address = rec_start;
+        auto&    last = merged.back();
+        uint32_t last_end = last.address + last.data.size();
+        if (segment.address + segment.data.size() > last_end) {
+            auto tail = segment.data.begin() + (last_end - segment.address);
+            last.data.insert(last.data.end(), tail, segment.data.end());
         }
-        memset(rec_line, 0, 524);
     }
 
+    return load_segments(move(merged), name);
+}
+
+int IntelHexFile::load_segments(vector<ImageSegment> data,
+                                const string&        name) {
+    firmware_size = 0;
+    base_address = 0;
+    segments = move(data);
+    page_buffer.clear();
+    nvm_pages.clear();
+
+    for (auto& segment : segments) {
+        if ((uint64_t)segment.address + segment.data.size() > nvm_flash_size) {
+            stringstream ss;
+            ss << name << ": data at 0x" << hex << segment.address
+               << " exceeds the flash";
+            cerr << ss.str() << endl;
+            throw ios_base::failure(ss.str());
+        }
+        firmware_size += segment.data.size();
+    }
+
+    return build_pages(name);
+}
+
+int IntelHexFile::build_pages(const string& name) {
+    merge_segments(name);
     cout << "total size " << firmware_size << endl;
-    // Align binary data on page size
-    if ((firmware_size % nvm_page_size) != 0) {
-        uint32_t rounded_size =
-            ((firmware_size + nvm_page_size - 1) / nvm_page_size) *
-            nvm_page_size;
-        nvm_data.resize(rounded_size);
+
+    // Split data into progam pages, only where the image holds data. The
+    // page list is built first, so the data of all pages is allocated once
+    for (auto& segment : segments) {
+        uint32_t end_address = segment.address + segment.data.size();
+
+        for (uint32_t page_addr =
+                 segment.address - segment.address % nvm_page_size;
+             page_addr < end_address; page_addr += nvm_page_size) {
+            // Segments may share a page
+            if (nvm_pages.empty() || nvm_pages.back().address != page_addr) {
+                ProgramPage p;
+                p.address = page_addr;
+                p.pageSize = nvm_page_size;
+                p.data = nullptr;
+                nvm_pages.push_back(p);
+            }
+        }
     }
 
-    cout << "after alignment, total size " << nvm_data.size() << endl;
+    page_buffer.assign(nvm_pages.size() * nvm_page_size, 0xFF);
+    auto page = nvm_pages.begin();
+    for (auto& segment : segments) {
+        uint32_t address = segment.address;
+        uint32_t end_address = segment.address + segment.data.size();
 
-    // Split data into progam pages
-    for (size_t i = 0; i < nvm_data.size(); i += nvm_page_size) {
-        vector<uint8_t> pageData(nvm_data.begin() + i,
-                                 nvm_data.begin() + i + nvm_page_size);
-        ProgramPage     p;
-        p.address = i;
-        p.pageSize = nvm_page_size;
-        p.data.swap(pageData);
-        nvm_pages.push_back(p);
+        while (address < end_address) {
+            uint32_t page_addr = address - address % nvm_page_size;
+            uint32_t page_end =
+                min<uint32_t>(page_addr + nvm_page_size, end_address);
+
+            while (page->address != page_addr) {
+                page++;
+            }
+            uint8_t* page_data =
+                &page_buffer[(page - nvm_pages.begin()) * nvm_page_size];
+            page->data = page_data;
+
+            copy(segment.data.begin() + (address - segment.address),
+                 segment.data.begin() + (page_end - segment.address),
+                 page_data + (address - page_addr));
+            address = page_end;
+        }
     }
 
-    return start_address;
+    cout << "after alignment, total size " << nvm_pages.size() * nvm_page_size
+         << endl;
+
+    return segments.empty() ? 0 : segments.front().address;
 }
 
-const vector<ProgramPage>& IntelHexFile::get_page_data() {
+bool IntelHexFile::flush_pages(uint64_t                 end,
+                               uint32_t&                flushed_end,
+                               uint32_t&                page_count,
+                               const PageReadyCallback& page_ready) {
+    // Segments are in ascending order and don't overlap, the pages are built
+    // from their front and the used data is dropped
+    while (!segments.empty()) {
+        uint32_t page_addr =
+            segments.front().address - segments.front().address % nvm_page_size;
+        uint32_t page_end = page_addr + nvm_page_size;
+        if (page_end > end) {
+            return true;
+        }
+
+        page_buffer.assign(nvm_page_size, 0xFF);
+        while (!segments.empty() && segments.front().address < page_end) {
+            auto&  segment = segments.front();
+            size_t count =
+                min<size_t>(segment.data.size(), page_end - segment.address);
+
+            copy(segment.data.begin(), segment.data.begin() + count,
+                 page_buffer.begin() + (segment.address - page_addr));
+            if (count == segment.data.size()) {
+                segments.erase(segments.begin());
+            } else {
+                segment.data.erase(segment.data.begin(),
+                                   segment.data.begin() + count);
+                segment.address += count;
+            }
+        }
+
+        ProgramPage page = {page_addr, nvm_page_size, page_buffer.data()};
+        flushed_end = page_end;
+        page_count++;
+        if (!page_ready(page)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int IntelHexFile::parse_line(const char*   record,
+                             size_t        length,
+                             int           line_number,
+                             const string& name) {
+    if (length && record[length - 1] == '\r') {
+        length--;
+    }
+    if (!length) {
+        return -1;
+    }
+
+    string parse_error;
+    size_t error_column = 0;
+    int record_type = parse_record(record, length, error_column, parse_error);
+    if (record_type < 0) {
+        stringstream ss;
+        ss << name << ":" << line_number << ":" << error_column + 1 << ": "
+           << parse_error;
+        cerr << ss.str() << endl;
+        throw ios_base::failure(ss.str());
+    }
+
+    return record_type;
+}
+
+void IntelHexFile::merge_segments(const string& name) {
+    vector<ImageSegment> merged;
+
+    // Records are mostly in order, so this is usually a no-op
+    stable_sort(segments.begin(), segments.end(),
+                [](const ImageSegment& a, const ImageSegment& b) {
+                    return a.address < b.address;
+                });
+
+    for (auto& segment : segments) {
+        if (merged.empty()) {
+            merged.push_back(move(segment));
+            continue;
+        }
+
+        auto&    last = merged.back();
+        uint32_t last_end = last.address + last.data.size();
+        if (segment.address < last_end) {
+            stringstream ss;
+            ss << name << ": data at 0x" << hex << segment.address
+               << " is defined twice";
+            cerr << ss.str() << endl;
+            throw ios_base::failure(ss.str());
+        }
+
+        if (segment.address == last_end) {
+            last.data.insert(last.data.end(), segment.data.begin(),
+                             segment.data.end());
+        } else {
+            merged.push_back(move(segment));
+        }
+    }
+
+    segments.swap(merged);
+}
+
+const vector<ProgramPage>& IntelHexFile::get_page_data() const {
     return nvm_pages;
 }
 
-const std::vector<uint8_t>& IntelHexFile::get_flash_data() {
-    return nvm_data;
+const vector<ImageSegment>& IntelHexFile::get_segments() const {
+    return segments;
 }
 
-int IntelHexFile::parse_record(const std::string& record, string& error) {
+int IntelHexFile::parse_record(const char* record,
+                               size_t      length,
+                               size_t&     error_column,
+                               string&     error) {
     if (record[0] != ':') {
+        error_column = 0;
         error = "Wrong start of record";
         return -1;
     }
 
-    uint8_t  count = 2 * asciiHexTo64(record.substr(1, 2));
-    uint8_t  high_addr = asciiHexTo64(record.substr(3, 2));
-    uint8_t  low_addr = asciiHexTo64(record.substr(5, 2));
-    uint16_t start_addr = ((high_addr << 8) | low_addr);
-    uint8_t  recordType = asciiHexTo64(record.substr(7, 2));
+    if (length < RECORD_MIN_SIZE) {
+        error_column = length;
+        error = "Record too short";
+        return -1;
+    }
 
-    if (recordType != 0 && recordType != 1) {
-        error = "Unsupported record type";
-        return -1;  // Unsupported record type
+    // Every field is a hex byte, decoded and summed up in one pass
+    uint8_t bytes[4];
+    uint8_t cChecksum = 0;
+    for (size_t i = 0; i < 4; i++) {
+        int v = decode_byte(record, 1 + 2 * i);
+        if (v < 0) {
+            error_column = 1 + 2 * i;
+            error = "Invalid hex digit";
+            return -1;
+        }
+        bytes[i] = v;
+        cChecksum += v;
     }
 
-    uint8_t cChecksum = (count / 2) + high_addr + low_addr + recordType;
+    uint8_t  count = bytes[0];
+    uint16_t offset = (bytes[1] << 8) | bytes[2];
+    uint8_t  recordType = bytes[3];
 
-    if (count != record.length() - (9 + 2 + 1)) {
+    // Address records carry a 16 bit segment or upper address, start
+    // address records a 32 bit CS:IP or EIP
+    size_t expected_count = count;
+    switch (recordType) {
+        case RECORD_DATA:
+            break;
+        case RECORD_END_OF_FILE:
+            expected_count = 0;
+            break;
+        case RECORD_EXTENDED_SEGMENT_ADDRESS:
+        case RECORD_EXTENDED_LINEAR_ADDRESS:
+            expected_count = 2;
+            break;
+        case RECORD_START_SEGMENT_ADDRESS:
+        case RECORD_START_LINEAR_ADDRESS:
+            expected_count = 4;
+            break;
+        default:
+            error_column = 7;
+            error = "Unsupported record type";
+            return -1;  // Unsupported record type
+    }
+
+    if (count != expected_count ||
+        length != RECORD_MIN_SIZE + 2 * (size_t)count) {
+        error_column = 1;
         error = "Wrong data size";
         return -1;  // record data size is wrong
     }
 
-    // Fill the nvm_data
-    for (uint8_t i = 0; i < count; i += 2) {
-        uint8_t v = asciiHexTo64(record.substr(9 + i, 2));
+    uint32_t address = base_address + offset;
+    if (recordType == RECORD_DATA && count) {
+        if (segments.empty() ||
+            segments.back().address + segments.back().data.size() !=
+                address) {
+            segments.push_back(ImageSegment{address, vector<uint8_t>()});
+        }
+    }
+
+    // Decode the data, only data records keep it
+    uint32_t value = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t pos = RECORD_HEADER_SIZE + 2 * i;
+        int    v = decode_byte(record, pos);
+        if (v < 0) {
+            error_column = pos;
+            error = "Invalid hex digit";
+            return -1;
+        }
         cChecksum += v;
-        if ((start_addr + i / 2) > nvm_flash_size) {
+        value = (value << 8) | v;
+
+        if (recordType != RECORD_DATA) {
+            continue;
+        }
+        if ((uint64_t)address + i >= nvm_flash_size) {
+            error_column = pos;
             error = "Exceed maximum flash size";
             return -1;  // exceed maximum flash size
         }
 
-        nvm_data[start_addr + i / 2] = v;
+        segments.back().data.push_back(v);
         firmware_size++;
     }
 
-    uint8_t checksum = asciiHexTo64(record.substr(record.length() - 3, 2));
+    int checksum = decode_byte(record, length - 2);
+    if (checksum < 0) {
+        error_column = length - 2;
+        error = "Invalid hex digit";
+        return -1;
+    }
 
     // Verify if checksum is 2's complement
     if (((uint8_t)(cChecksum + checksum)) != 0) {
+        error_column = length - 2;
         error = "Failed to verify checksum";
         return -1;
     }
 
-    return start_addr;
+    // Data of the following records is relative to the new base
+    if (recordType == RECORD_EXTENDED_SEGMENT_ADDRESS) {
+        base_address = value << 4;
+    } else if (recordType == RECORD_EXTENDED_LINEAR_ADDRESS) {
+        base_address = value << 16;
+    }
+
+    return recordType;
 }
 
-}  // namespace updi
\ No newline at end of file
+}  // namespace updi
@@ -1,17 +1,32 @@
 #include <glib-unix.h>
 #include <glib.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <thread>
 #include <vector>
 
+#include "data_sampler.h"
+#include "device_manifest.h"
+#include "elf_file.h"
+#include "fuse_profile.h"
+#include "gang_programmer.h"
 #include "nvm_programmer.h"
+#include "programming_daemon.h"
+#include "programming_image.h"
+#include "programming_job.h"
+#include "programming_plan.h"
+#include "unit_serializer.h"
 #include "updi_common.h"
 
 using namespace updi;
@@ -27,9 +42,37 @@ static gboolean read_chip_info = false;
 static gint     write_fuse_number = -1;
 static gint     read_fuse_number = -1;
 static gint     fuse_value = -1;
+static char*    fuse_list = nullptr;
+static char*    fuse_file = nullptr;
+static gint     retry_budget = -1;
+static gint     job_timeout = 0;
+static gboolean keep_progmode = false;
+static char*    sample_list = nullptr;
+static gint     sample_count = 0;
+static char*    sample_output = nullptr;
+static char*    flash_section = nullptr;
+static gboolean blank_check = false;
+static char*    journal_file = nullptr;
+static char*    manifest_file = nullptr;
+static char*    serial_counter = nullptr;
+static char*    serial_field = nullptr;
+static char*    serial_csv = nullptr;
+static char*    timestamp_field = nullptr;
+static char*    gang_ports = nullptr;
+static gboolean loop_mode = false;
+static gboolean dry_run = false;
+static char*    state_file = nullptr;
+static char*    convert_file = nullptr;
+static gboolean stream_flash = false;
+static char*    daemon_socket = nullptr;
 static gboolean verbose = false;
 
-static unique_ptr<NvmProgrammer> nvm = nullptr;
+static unique_ptr<NvmProgrammer>     nvm = nullptr;
+static unique_ptr<DataSampler>       sampler = nullptr;
+static unique_ptr<ProgrammingDaemon> daemon_server = nullptr;
+
+static DeviceManifest                 manifest;
+static map<uint32_t, ProgrammingJob> manifest_jobs;
 
 static GOptionEntry entries[] = {
     {"device", 'd', 0, G_OPTION_ARG_STRING, &device_name, "Target device",
@@ -37,10 +80,62 @@ static GOptionEntry entries[] = {
     {"comport", 'c', 0, G_OPTION_ARG_STRING, &com_port, "Com port to use",
      "/dev/ttyX"},
     {"baudrate", 'b', 0, G_OPTION_ARG_INT, &baud_rate, "Baud rate", "115200"},
-    {"flash", 'f', 0, G_OPTION_ARG_STRING, &hex_file, "Intel HEX file to flash",
+    {"flash", 'f', 0, G_OPTION_ARG_STRING, &hex_file,
+     "Intel HEX, ELF or precompiled image file to flash (ELF files and "
+     "images also program EEPROM, user row and fuses), - reads HEX from "
+     "standard input, a comma separated list merges HEX files",
+     nullptr},
+    {"stream", 0, 0, G_OPTION_ARG_NONE, &stream_flash,
+     "Write pages of the --flash HEX file while it is still read, e.g. "
+     "from a pipe (records in ascending address order)",
      nullptr},
     {"erase", 'e', 0, G_OPTION_ARG_NONE, &chip_erase,
      "Perform a chip erase (implied with --flash)", nullptr},
+    {"gang", 0, 0, G_OPTION_ARG_STRING, &gang_ports,
+     "Program several targets in parallel (instead of --comport)",
+     "/dev/ttyX,/dev/ttyY"},
+    {"loop", 'l', 0, G_OPTION_ARG_NONE, &loop_mode,
+     "Keep the port open and program every unit inserted until Ctrl-C",
+     nullptr},
+    {"daemon", 0, 0, G_OPTION_ARG_STRING, &daemon_socket,
+     "Serve programming jobs on a Unix socket and keep sessions warm "
+     "(instead of --comport)",
+     "/tmp/updi.sock"},
+    {"dry-run", 0, 0, G_OPTION_ARG_NONE, &dry_run,
+     "Print the programming plan and time estimate, the target is not "
+     "touched",
+     nullptr},
+    {"state", 0, 0, G_OPTION_ARG_STRING, &state_file,
+     "Intel HEX file already on the target, for --dry-run", "old.hex"},
+    {"convert", 0, 0, G_OPTION_ARG_STRING, &convert_file,
+     "Write --flash and the fuse profile as a precompiled image for "
+     "--device, the target is not touched",
+     "firmware.updi"},
+    {"blankcheck", 0, 0, G_OPTION_ARG_NONE, &blank_check,
+     "Skip the chip erase before flashing if flash is proven blank", nullptr},
+    {"manifest", 'm', 0, G_OPTION_ARG_STRING, &manifest_file,
+     "Identify every unit by its signature and flash the device profile, "
+     "image and fuses listed for it (instead of --device and --flash)",
+     "station.txt"},
+    {"journal", 0, 0, G_OPTION_ARG_STRING, &journal_file,
+     "Record verified pages, so an interrupted --flash on the same unit "
+     "resumes without chip erase",
+     "journal.txt"},
+    {"serialcounter", 0, 0, G_OPTION_ARG_STRING, &serial_counter,
+     "Patch a serial number from a counter file into every unit (needs "
+     "--serialfield)",
+     "serial.txt"},
+    {"serialfield", 0, 0, G_OPTION_ARG_STRING, &serial_field,
+     "Flash offset and size of the serial number", "0x3FF0:4"},
+    {"serialcsv", 0, 0, G_OPTION_ARG_STRING, &serial_csv,
+     "Patch per-unit data from a CSV file (header lists offset:size fields)",
+     "units.csv"},
+    {"timestamp", 0, 0, G_OPTION_ARG_STRING, &timestamp_field,
+     "Patch the programming time into every unit", "0x3FF8:4"},
+    {"section", 0, 0, G_OPTION_ARG_STRING, &flash_section,
+     "Only erase, write and verify one flash section (boot, appcode or "
+     "appdata) instead of the whole chip",
+     "appcode"},
     {"reset", 'r', 0, G_OPTION_ARG_NONE, &chip_reset, "Reset chip", nullptr},
     {"info", 'i', 0, G_OPTION_ARG_NONE, &read_chip_info, "Read chip info",
      nullptr},
@@ -54,38 +149,577 @@ static GOptionEntry entries[] = {
      nullptr},
     {"readfuse", 0, 0, G_OPTION_ARG_INT, &read_fuse_number,
      "Read out the fuse-bits", nullptr},
+    {"fuses", 0, 0, G_OPTION_ARG_STRING, &fuse_list,
+     "Apply a fuse profile, only differing fuses are written",
+     "BODCFG=0x54,SYSCFG0=0xF6"},
+    {"fusefile", 0, 0, G_OPTION_ARG_STRING, &fuse_file,
+     "Apply a fuse profile file (one <fuse>=<value> per line)", nullptr},
+    {"retries", 0, 0, G_OPTION_ARG_INT, &retry_budget,
+     "Retries allowed per erase/write/read after a protocol error", "3"},
+    {"timeout", 't', 0, G_OPTION_ARG_INT, &job_timeout,
+     "Give up on a unit after this many ms (default no limit)", "8000"},
+    {"keepprogmode", 'k', 0, G_OPTION_ARG_NONE, &keep_progmode,
+     "Keep the target in programming mode for the next invocation", nullptr},
+    {"sample", 's', 0, G_OPTION_ARG_STRING, &sample_list,
+     "Sample data space locations while the application runs",
+     "0x3800:2,0x0610:2"},
+    {"samples", 0, 0, G_OPTION_ARG_INT, &sample_count,
+     "Number of samples (default until interrupted)", nullptr},
+    {"sampleout", 0, 0, G_OPTION_ARG_STRING, &sample_output,
+     "CSV file for the samples (default stdout)", nullptr},
 
     {nullptr}};
 
-static int flash_file(const std::string& hexfile) {
-    uint32_t     start_address = 0;
-    auto         device = nvm->get_device();
-    IntelHexFile ihex(device->get_flash_size(), device->get_flash_pagesize());
+static vector<string> split_list(const string& list) {
+    vector<string> items;
+    stringstream   ss(list);
+    string         item;
+
+    while (getline(ss, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// ELF files also hold EEPROM, User Row and fuse data, their fuses are handed
+// back so a fuse profile can override them
+static int load_image(ProgrammingJob&         job,
+                      const string&           device_name,
+                      const string&           filename,
+                      map<uint32_t, uint8_t>& image_fuses) {
+    AvrDevice device(device_name);
+
+    image_fuses.clear();
+    job.set_eeprom(vector<ImageSegment>());
+    job.set_user_row(vector<ImageSegment>());
+    if (ProgrammingImage::is_image_file(filename)) {
+        auto image = make_shared<ProgrammingImage>(
+            device.get_flash_size(), device.get_flash_pagesize());
+        try {
+            image->load_file(filename);
+        } catch (const ios_base::failure& e) {
+            cerr << "Failed to load image file. Exception: " << e.what()
+                 << endl;
+            return -1;
+        }
+
+        if (image->get_device_name() != device_name) {
+            cerr << filename << " is built for " << image->get_device_name()
+                 << ", not " << device_name << endl;
+            return -1;
+        }
+        job.set_image(image);
+        job.set_eeprom(image->get_eeprom());
+        job.set_user_row(image->get_user_row());
+        image_fuses = image->get_fuses();
+        return 0;
+    }
+
+    // A list of HEX files is merged into one image
+    auto files = split_list(filename);
+    if (files.size() > 1 || !ElfFile::is_elf_file(filename)) {
+        auto ihex = make_shared<IntelHexFile>(device.get_flash_size(),
+                                              device.get_flash_pagesize());
+        try {
+            if (files.size() > 1) {
+                ihex->load_files(files);
+            } else {
+                ihex->load_file(filename);
+            }
+        } catch (const ios_base::failure& e) {
+            cerr << "Failed to load hex file. Exception: " << e.what() << endl;
+            return -1;
+        }
+        job.set_image(ihex);
+        return 0;
+    }
+
+    auto elf = make_shared<ElfFile>(device.get_flash_size(),
+                                    device.get_flash_pagesize());
+    try {
+        elf->load_file(filename);
+    } catch (const ios_base::failure& e) {
+        cerr << "Failed to load ELF file. Exception: " << e.what() << endl;
+        return -1;
+    }
+
+    // Without flash data the flash is left alone, the flash image shares
+    // the lifetime of the ELF file
+    if (elf->get_flash().get_page_data().empty()) {
+        job.set_image(shared_ptr<const IntelHexFile>());
+    } else {
+        job.set_image(shared_ptr<const IntelHexFile>(elf, &elf->get_flash()));
+    }
+    job.set_eeprom(elf->get_eeprom());
+    job.set_user_row(elf->get_user_row());
+    image_fuses = elf->get_fuses();
+    return 0;
+}
+
+// Fuses of the profile override the fuses of the image
+static map<uint32_t, uint8_t> merge_fuses(
+    const map<uint32_t, uint8_t>& image_fuses,
+    const FuseProfile&            fuse_profile) {
+    auto fuses = fuse_profile.get_fuses();
+
+    fuses.insert(image_fuses.begin(), image_fuses.end());
+    return fuses;
+}
+
+static int prepare_job(ProgrammingJob& job, const FuseProfile& fuse_profile) {
+    map<uint32_t, uint8_t> image_fuses;
+
+    // A streamed file is parsed by the run itself
+    if (stream_flash) {
+        job.set_stream(hex_file);
+    } else if (hex_file &&
+               load_image(job, device_name, hex_file, image_fuses) < 0) {
+        return -1;
+    }
+
+    if (flash_section) {
+        string section = flash_section;
+        if (section == "boot") {
+            job.set_section(FLASH_SECTION_BOOT);
+        } else if (section == "appcode") {
+            job.set_section(FLASH_SECTION_APPCODE);
+        } else if (section == "appdata") {
+            job.set_section(FLASH_SECTION_APPDATA);
+        } else {
+            cerr << "Unknown flash section " << section << endl;
+            return -1;
+        }
+    }
+
+    if (journal_file) {
+        job.set_journal(journal_file);
+    }
+
+    if (serial_counter || serial_csv || timestamp_field) {
+        auto serializer = make_shared<UnitSerializer>();
+
+        try {
+            if (serial_counter) {
+                if (!serial_field) {
+                    cerr << "--serialcounter needs --serialfield" << endl;
+                    return -1;
+                }
+                serializer->set_counter(
+                    serial_counter, UnitSerializer::parse_field(serial_field));
+            }
+            if (serial_csv) {
+                serializer->set_csv(serial_csv);
+            }
+            if (timestamp_field) {
+                serializer->set_timestamp(
+                    UnitSerializer::parse_field(timestamp_field));
+            }
+        } catch (const exception& e) {
+            cerr << "Invalid unit data. Exception: " << e.what() << endl;
+            return -1;
+        }
+        job.set_serializer(serializer);
+    }
+
+    job.set_blank_check(blank_check);
+    job.set_fuse_profile(merge_fuses(image_fuses, fuse_profile));
+    return 0;
+}
+
+// Every device model of the manifest gets its own job, images and fuse
+// profiles are loaded up front
+static int prepare_manifest_jobs(const ProgrammingJob& job) {
+    try {
+        manifest.load_file(manifest_file);
+    } catch (const ios_base::failure& e) {
+        cerr << "Invalid manifest. Exception: " << e.what() << endl;
+        return -1;
+    }
+
+    for (auto& entry : manifest.get_entries()) {
+        ProgrammingJob         device_job = job;
+        FuseProfile            fuse_profile;
+        map<uint32_t, uint8_t> image_fuses;
+
+        if (load_image(device_job, entry.device_name, entry.image_file,
+                       image_fuses) < 0) {
+            return -1;
+        }
+
+        // Fuses given on the command line override the manifest, which
+        // overrides the image
+        try {
+            if (!entry.fuse_file.empty()) {
+                fuse_profile.load_file(entry.fuse_file);
+            }
+            if (fuse_file) {
+                fuse_profile.load_file(fuse_file);
+            }
+            if (fuse_list) {
+                fuse_profile.load_string(fuse_list);
+            }
+        } catch (const exception& e) {
+            cerr << "Invalid fuse profile. Exception: " << e.what() << endl;
+            return -1;
+        }
 
+        device_job.set_fuse_profile(merge_fuses(image_fuses, fuse_profile));
+        manifest_jobs[entry.signature] = device_job;
+    }
+
+    return 0;
+}
+
+// Pick the job of the connected unit, the unit has to be unlocked
+static const ProgrammingJob* select_job(const ProgrammingJob& job) {
+    if (!manifest_file) {
+        return &job;
+    }
+
+    uint32_t signature = 0;
     try {
-        start_address = ihex.load_file(hexfile);
+        signature = nvm->read_signature();
+    } catch (const UpdiException& e) {
+        cerr << "Failed to read device signature. Exception: " << e.what()
+             << endl;
+        return nullptr;
+    }
+
+    auto entry = manifest.find(signature);
+    if (!entry) {
+        cerr << "Device signature 0x" << hex << signature << dec
+             << " is not listed in the manifest" << endl;
+        return nullptr;
+    }
+
+    cout << "Identified " << entry->device_name << " (signature 0x" << hex
+         << signature << dec << ")" << endl;
+    nvm->set_device(entry->device_name);
+    return &manifest_jobs[signature];
+}
+
+static int run_job(const ProgrammingJob& job) {
+    try {
+        job.run(*nvm);
+    } catch (const UpdiException& e) {
+        cerr << "Programming failed. Exception: " << e.what() << endl;
+        return -1;
     } catch (const ios_base::failure& e) {
-        cerr << "Failed to load hex file. Exception: " << e.what() << endl;
+        cerr << "Programming failed. Exception: " << e.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int print_plan(const ProgrammingJob& job, const string& device_name) {
+    AvrDevice               device(device_name);
+    map<uint32_t, uint64_t> state;
+
+    if (state_file) {
+        IntelHexFile current(device.get_flash_size(),
+                             device.get_flash_pagesize());
+        try {
+            current.load_file(state_file);
+        } catch (const ios_base::failure& e) {
+            cerr << "Failed to load state file. Exception: " << e.what()
+                 << endl;
+            return -1;
+        }
+        state = ProgrammingPlan::image_state(current.get_page_data(),
+                                             device.get_flash_size(),
+                                             device.get_flash_pagesize());
+    }
+
+    job.make_plan(device, baud_rate, state).print(cout);
+    return 0;
+}
+
+// Everything is decoded once here, so stations only map the image
+static int run_convert(const string& filename) {
+    AvrDevice              device(device_name);
+    IntelHexFile           ihex(device.get_flash_size(),
+                                device.get_flash_pagesize());
+    ElfFile                elf(device.get_flash_size(),
+                               device.get_flash_pagesize());
+    const IntelHexFile*    flash = &ihex;
+    vector<ImageSegment>   eeprom;
+    vector<ImageSegment>   user_row;
+    map<uint32_t, uint8_t> image_fuses;
+    FuseProfile            fuse_profile;
+
+    if (!hex_file) {
+        cerr << "--convert needs --flash" << endl;
         return -1;
     }
 
-    nvm->chip_erase();
+    try {
+        if (fuse_file) {
+            fuse_profile.load_file(fuse_file);
+        }
+        if (fuse_list) {
+            fuse_profile.load_string(fuse_list);
+        }
+    } catch (const exception& e) {
+        cerr << "Invalid fuse profile. Exception: " << e.what() << endl;
+        return -1;
+    }
 
-    auto pages = ihex.get_page_data();
-    nvm->write_flash(start_address, pages);
+    try {
+        if (ElfFile::is_elf_file(hex_file)) {
+            elf.load_file(hex_file);
+            flash = &elf.get_flash();
+            eeprom = elf.get_eeprom();
+            user_row = elf.get_user_row();
+            image_fuses = elf.get_fuses();
+        } else if (split_list(hex_file).size() > 1) {
+            ihex.load_files(split_list(hex_file));
+        } else {
+            ihex.load_file(hex_file);
+        }
+
+        ProgrammingImage::write_file(filename, device, *flash, eeprom,
+                                     user_row,
+                                     merge_fuses(image_fuses, fuse_profile));
+    } catch (const ios_base::failure& e) {
+        cerr << "Failed to convert " << hex_file << ". Exception: " << e.what()
+             << endl;
+        return -1;
+    }
 
-    // Read out pages of flash again
-    // This is to verify if flashing is successful
-    vector<uint8_t> flash_data = nvm->read_flash(
-        device->get_flash_start_addr(), pages.size() * device->get_flash_pagesize());
-    auto hex_data = ihex.get_flash_data();
+    return 0;
+}
 
-    if (!std::equal(hex_data.begin(), hex_data.end(), flash_data.begin())) {
-        cerr << "Flash verification error" << endl;
+static int run_dry_run(const ProgrammingJob& job) {
+    if (flash_section || journal_file) {
+        cerr << "--dry-run plans whole chip flashing, it can't be combined "
+                "with --section or --journal"
+             << endl;
+        return -1;
+    }
+
+    if (!manifest_file) {
+        if (!job.has_image()) {
+            cerr << "--dry-run needs --flash or --manifest" << endl;
+            return -1;
+        }
+        return print_plan(job, device_name);
+    }
+
+    for (auto& entry : manifest.get_entries()) {
+        if (print_plan(manifest_jobs[entry.signature], entry.device_name) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int run_gang(const ProgrammingJob& job, const string& port_list) {
+    vector<string> ports = split_list(port_list);
+    int            failed = 0;
+
+    GangProgrammer gang(ports, baud_rate, device_name);
+    if (retry_budget >= 0) {
+        gang.set_retry_budget(retry_budget);
+    }
+    if (job_timeout > 0) {
+        gang.set_deadline(job_timeout);
+    }
+
+    auto start = chrono::steady_clock::now();
+    auto results = gang.run(job);
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(
+                       chrono::steady_clock::now() - start)
+                       .count();
+
+    cout << endl << "Gang programming results:" << endl;
+    for (auto& r : results) {
+        cout << "  " << r.port << ": " << (r.success ? "OK" : "FAILED") << " ("
+             << r.elapsed_ms << " ms";
+        if (r.success && r.report.erase_skipped) {
+            cout << ", erase skipped";
+        }
+        cout << ")";
+        if (!r.success) {
+            cout << " " << r.error;
+            failed++;
+        }
+        cout << endl;
+    }
+    cout << results.size() - failed << " of " << results.size()
+         << " units programmed in " << elapsed << " ms" << endl;
+
+    return failed ? -1 : 0;
+}
+
+static atomic<bool> loop_stopped(false);
+
+static void stop_loop(int /*signum*/) {
+    loop_stopped = true;
+}
+
+// Contacts of a test fixture bounce, so a state change is only accepted
+// after consecutive matching probes
+static bool wait_for_target(bool present) {
+    int matches = 0;
+
+    while (!loop_stopped) {
+        if (nvm->probe_target() == present) {
+            if (++matches == 2) {
+                return true;
+            }
+        } else {
+            matches = 0;
+        }
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+
+    return false;
+}
+
+static int program_unit(const ProgrammingJob& job) {
+    // Also disarmed if the unit fails before programming mode is left
+    DeadlineGuard deadline_guard(*nvm);
+    if (job_timeout > 0) {
+        nvm->set_deadline(job_timeout);
+    }
+
+    try {
+        nvm->get_device_info();
+        try {
+            nvm->enter_progmode();
+        } catch (const UpdiDeadlineException& e) {
+            cerr << "Failed to enter programming mode. Exception: "
+                 << e.what() << endl;
+            return -1;
+        } catch (const UpdiException& e) {
+            cerr << "Device is locked. Perform unlock with chip erase first"
+                 << endl;
+            nvm->unlock_device();
+        }
+    } catch (const UpdiException& e) {
+        cerr << "Failed to prepare unit. Exception: " << e.what() << endl;
+        return -1;
+    }
+
+    // The unit is identified before the explicit erase, so an unlisted
+    // unit is left intact
+    auto unit_job = select_job(job);
+    int  result = unit_job ? 0 : -1;
+    if (unit_job && chip_erase) {
+        try {
+            nvm->chip_erase();
+        } catch (const UpdiException& e) {
+            cerr << "Failed to erase chip. Exception: " << e.what() << endl;
+            result = -1;
+        }
+    }
+    if (result == 0) {
+        result = run_job(*unit_job);
+    }
+
+    try {
+        nvm->leave_progmode();
+    } catch (const UpdiException& e) {
+        cerr << "Failed to leave programming mode. Exception: " << e.what()
+             << endl;
+    }
+
+    return result;
+}
+
+static int run_loop(const ProgrammingJob& job) {
+    uint32_t units = 0;
+    uint32_t failed = 0;
+
+    signal(SIGINT, stop_loop);
+
+    while (!loop_stopped) {
+        cout << "Waiting for target..." << endl;
+        if (!wait_for_target(true)) {
+            break;
+        }
+
+        auto start = chrono::steady_clock::now();
+        int  result = program_unit(job);
+        auto elapsed = chrono::duration_cast<chrono::milliseconds>(
+                           chrono::steady_clock::now() - start)
+                           .count();
+
+        units++;
+        failed += result < 0;
+        cout << "Unit " << units << ": " << (result < 0 ? "FAIL" : "PASS")
+             << " in " << elapsed << " ms" << endl;
+
+        cout << "Remove target" << endl;
+        wait_for_target(false);
+    }
+
+    cout << units - failed << " of " << units << " units programmed" << endl;
+    return failed ? -1 : 0;
+}
+
+static void stop_sampling(int /*signum*/) {
+    if (sampler) {
+        sampler->stop();
+    }
+}
+
+static int sample_data(const string& channel_list) {
+    vector<SampleChannel> channels;
+    ofstream              file;
+
+    try {
+        channels = DataSampler::parse_channels(channel_list);
+    } catch (const invalid_argument& e) {
+        cerr << e.what() << endl;
+        return -1;
+    }
+
+    if (sample_output) {
+        file.open(sample_output);
+        if (!file.is_open()) {
+            cerr << "Failed to open " << sample_output << endl;
+            return -1;
+        }
+    }
+
+    sampler = make_unique<DataSampler>(*nvm, channels);
+    signal(SIGINT, stop_sampling);
+
+    try {
+        sampler->run(sample_output ? file : cout, sample_count);
+    } catch (const UpdiException& e) {
+        cerr << "Sampling failed. Exception: " << e.what() << endl;
+        return -1;
+    }
+
+    cerr << "Sample rate " << sampler->get_sample_rate() << " samples/s"
+         << endl;
+    return 0;
+}
+
+static void stop_daemon(int /*signum*/) {
+    if (daemon_server) {
+        daemon_server->stop();
+    }
+}
+
+static int run_daemon(const string& socket_path) {
+    daemon_server =
+        make_unique<ProgrammingDaemon>(socket_path, device_name, baud_rate);
+    signal(SIGINT, stop_daemon);
+    signal(SIGTERM, stop_daemon);
+
+    try {
+        daemon_server->run();
+    } catch (const exception& e) {
+        cerr << "Daemon failed. Exception: " << e.what() << endl;
         return -1;
     }
 
-    cout << "Programming successful" << endl;
     return 0;
 }
 
@@ -103,26 +737,151 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    if (!(device_name && com_port) || !baud_rate ||
+    if (!((device_name || manifest_file) &&
+          (com_port || gang_ports || daemon_socket || dry_run ||
+           convert_file)) ||
+        (!baud_rate && !convert_file) ||
         !(hex_file != nullptr || chip_erase || chip_reset || read_chip_info ||
-          write_fuse_number || read_fuse_number)) {
+          write_fuse_number || read_fuse_number || fuse_list || fuse_file ||
+          sample_list || daemon_socket || manifest_file)) {
         cerr << "No valid action (erase, flash, reset, read/write fuses or info)" << endl;
         return -1;
     }
 
     string supported_devices = AvrDevice::get_supported_devices();
-    if (supported_devices.find(device_name) == string::npos) {
+    if (device_name && supported_devices.find(device_name) == string::npos) {
         cerr << "Device " << device_name << " is not supported" << endl;
         cerr << "Current supported list: " << supported_devices << endl;
         return -1;
     }    
 
+    if (convert_file) {
+        if (!device_name || manifest_file) {
+            cerr << "--convert needs --device" << endl;
+            return -1;
+        }
+        return run_convert(convert_file);
+    }
+
+    if (manifest_file && (hex_file || gang_ports || daemon_socket)) {
+        cerr << "--manifest can't be combined with --flash, --gang or --daemon"
+             << endl;
+        return -1;
+    }
+
+    // Every attempt patches new unit data, so a rerun never matches the
+    // journal of the interrupted run
+    if (journal_file && (serial_counter || serial_csv || timestamp_field)) {
+        cerr << "--journal can't be combined with --serialcounter, "
+                "--serialcsv or --timestamp"
+             << endl;
+        return -1;
+    }
+
+    if (stream_flash &&
+        (!hex_file || split_list(hex_file).size() > 1 || manifest_file ||
+         gang_ports || daemon_socket || loop_mode || dry_run ||
+         flash_section || journal_file || serial_counter || serial_csv ||
+         timestamp_field)) {
+        cerr << "--stream needs a single --flash file and flashes a single "
+                "unit, it can't be combined with --manifest, --gang, "
+                "--daemon, --loop, --dry-run, --section, --journal or unit "
+                "data"
+             << endl;
+        return -1;
+    }
+
+    if (daemon_socket) {
+        return run_daemon(daemon_socket);
+    }
+
     if ((write_fuse_number >=0 || read_fuse_number >= 0) && fuse_value < 0) {
         cerr << "Invalid fuse value" << endl;
         return -1;
     }
 
+    FuseProfile fuse_profile;
+    try {
+        if (fuse_file) {
+            fuse_profile.load_file(fuse_file);
+        }
+        if (fuse_list) {
+            fuse_profile.load_string(fuse_list);
+        }
+    } catch (const exception& e) {
+        cerr << "Invalid fuse profile. Exception: " << e.what() << endl;
+        return -1;
+    }
+
+    ProgrammingJob job;
+    if (prepare_job(job, fuse_profile) < 0) {
+        return -1;
+    }
+
+    if (manifest_file) {
+        if (prepare_manifest_jobs(job) < 0) {
+            return -1;
+        }
+
+        // The session starts with the first profile until the unit is
+        // identified
+        if (!device_name) {
+            device_name =
+                g_strdup(manifest.get_entries().front().device_name.c_str());
+        }
+    }
+
+    if (dry_run) {
+        return run_dry_run(job);
+    }
+
+    if (state_file) {
+        cerr << "--state is only used with --dry-run" << endl;
+        return -1;
+    }
+
+    if (gang_ports) {
+        if (!hex_file && fuse_profile.empty()) {
+            cerr << "Gang programming needs --flash or a fuse profile" << endl;
+            return -1;
+        }
+        if (journal_file) {
+            cerr << "--journal is not supported in gang programming" << endl;
+            return -1;
+        }
+        return run_gang(job, gang_ports);
+    }
+
     nvm = make_unique<NvmProgrammer>(com_port, baud_rate, device_name);
+    if (retry_budget >= 0) {
+        nvm->set_retry_budget(retry_budget);
+    }
+
+    if (loop_mode) {
+        if (!hex_file && !manifest_file && fuse_profile.empty()) {
+            cerr << "Loop mode needs --flash or a fuse profile" << endl;
+            return -1;
+        }
+        return run_loop(job);
+    }
+
+    if (sample_list) {
+        // The application keeps running, so no programming mode and no reset
+        try {
+            nvm->get_device_info();
+        } catch (const UpdiException& e) {
+            cerr << e.what() << endl;
+            return -1;
+        }
+
+        result = sample_data(sample_list);
+        nvm->disconnect();
+        return result;
+    }
+
+    if (job_timeout > 0) {
+        nvm->set_deadline(job_timeout);
+    }
 
     if (!chip_reset) {
         string sib_str = nvm->get_device_info();
@@ -130,13 +889,22 @@ int main(int argc, char** argv) {
 
         try {
             nvm->enter_progmode();
+        } catch (const UpdiDeadlineException& e) {
+            cerr << "Failed to enter programming mode. Exception: "
+                 << e.what() << endl;
+            return -1;
         } catch (const UpdiException& e) {
             cerr << "Device is locked. Perform unlock with chip erase first"
                  << endl;
             nvm->unlock_device();
         }
 
-        if (chip_erase) {
+        // With a manifest the unit is identified before the explicit erase,
+        // so an unlisted unit is left intact
+        const ProgrammingJob* unit_job =
+            manifest_file ? select_job(job) : &job;
+
+        if (unit_job && chip_erase) {
             try {
                 nvm->chip_erase();
             } catch (const UpdiException& e) {
@@ -145,8 +913,10 @@ int main(int argc, char** argv) {
             }
         }
 
-        if (hex_file) {
-            result = flash_file(hex_file);
+        if (manifest_file) {
+            result = unit_job ? run_job(*unit_job) : -1;
+        } else if (hex_file || !fuse_profile.empty()) {
+            result = run_job(job);
         } else {
             if (write_fuse_number >= 0) {
                 try {
@@ -172,6 +942,23 @@ int main(int argc, char** argv) {
         }
     }
 
-    nvm->leave_progmode();
+    if (keep_progmode && !chip_reset) {
+        nvm->detach();
+    } else {
+        nvm->leave_progmode();
+    }
+
+    auto& stats = nvm->get_retry_stats();
+    if (stats.retries) {
+        cout << "Recovered protocol errors: " << stats.retries << " retries, "
+             << stats.link_resyncs << " link resyncs, "
+             << stats.progmode_reentries << " progmode re-entries" << endl;
+    }
+
+    auto& cache_stats = nvm->get_cache_stats();
+    if (verbose && (cache_stats.hits || cache_stats.misses)) {
+        cout << "Flash page cache: " << cache_stats.hits << " hits, "
+             << cache_stats.misses << " misses" << endl;
+    }
     return result;
 }
\ No newline at end of file
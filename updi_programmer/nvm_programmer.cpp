@@ -1,6 +1,12 @@
 #include "nvm_programmer.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
 #include "updi_common.h"
 
@@ -8,13 +14,77 @@ using namespace std;
 
 namespace updi {
 
+/*
+ * Runs the queued page operations of one programmer in order on a single
+ * worker thread, so pending operations don't hold a thread each
+ */
+class FlashExecutor {
+   public:
+    FlashExecutor() : _stopping(false), _worker(&FlashExecutor::run, this) {
+    }
+
+    ~FlashExecutor() {
+        {
+            lock_guard<mutex> guard(_lock);
+            _stopping = true;
+        }
+        _wakeup.notify_one();
+        _worker.join();
+    }
+
+    template <typename T>
+    future<T> post(function<T()> operation) {
+        // std::function needs a copyable target, packaged_task isn't
+        auto task = make_shared<packaged_task<T()>>(move(operation));
+        {
+            lock_guard<mutex> guard(_lock);
+            _tasks.push_back([task]() { (*task)(); });
+        }
+        _wakeup.notify_one();
+        return task->get_future();
+    }
+
+   private:
+    void run() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> guard(_lock);
+                _wakeup.wait(guard,
+                             [this]() { return _stopping || !_tasks.empty(); });
+                // Queued operations are finished before stopping, their
+                // futures must not be left without a result
+                if (_tasks.empty()) {
+                    return;
+                }
+                task = move(_tasks.front());
+                _tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    mutex                    _lock;
+    condition_variable       _wakeup;
+    deque<function<void()>>  _tasks;
+    bool                     _stopping;
+    thread                   _worker;
+};
+
 NvmProgrammer::NvmProgrammer(const std::string& port,
                              uint32_t           baud_rate,
                              const std::string& device_name)
-    : _programming(false) {
+    : _baud_rate(baud_rate),
+      _programming(false),
+      _retry_budget(3),
+      _retry_stats(),
+      _session_start(chrono::steady_clock::now()),
+      _bringup_ms(0),
+      _cache_stats() {
     _avr_device = make_shared<AvrDevice>(device_name);
-    _updi_application =
-        make_unique<UpdiApplication>(port, baud_rate, _avr_device);
+    _deadline = make_shared<Deadline>();
+    _updi_application = make_unique<UpdiApplication>(port, baud_rate,
+                                                     _avr_device, _deadline);
 }
 
 NvmProgrammer::~NvmProgrammer() {
@@ -25,17 +95,57 @@ std::string NvmProgrammer::get_device_info() {
 }
 
 void NvmProgrammer::enter_progmode() {
-    cout << "Enter NVM programming mode" << endl;
-    _updi_application->enter_progmode();
+    if (_updi_application->in_prog_mode()) {
+        cout << "Attach to target already in NVM programming mode" << endl;
+    } else {
+        cout << "Enter NVM programming mode" << endl;
+        _updi_application->enter_progmode();
+    }
+    _page_cache.clear();
     _programming = true;
+    report_bringup();
 }
 
 void NvmProgrammer::leave_progmode() {
     cout << "Leave NVM programming mode" << endl;    
+    _deadline->clear();
     _updi_application->leave_progmode();
+    _page_cache.clear();
     _programming = false;
 }
 
+void NvmProgrammer::detach() {
+    cout << "Keep target in NVM programming mode" << endl;
+    _deadline->clear();
+    _programming = false;
+}
+
+void NvmProgrammer::disconnect() {
+    cout << "Disable UPDI" << endl;
+    _deadline->clear();
+    _updi_application->disable_updi();
+    _programming = false;
+}
+
+bool NvmProgrammer::is_session_alive() {
+    try {
+        return _programming && _updi_application->in_prog_mode();
+    } catch (const UpdiException& e) {
+        return false;
+    }
+}
+
+bool NvmProgrammer::probe_target() {
+    if (!_updi_application->probe_target()) {
+        return false;
+    }
+
+    if (!_programming) {
+        _session_start = chrono::steady_clock::now();
+    }
+    return true;
+}
+
 void NvmProgrammer::unlock_device() {
     if (_programming) {
         cout << "Device already unlocked" << endl;
@@ -43,7 +153,9 @@ void NvmProgrammer::unlock_device() {
     }
 
     _updi_application->unlock();
+    _page_cache.clear();
     _programming = true;
+    report_bringup();
 }
 
 void NvmProgrammer::chip_erase() {
@@ -51,12 +163,113 @@ void NvmProgrammer::chip_erase() {
         throw UpdiException("Enter progmode first");
     }
 
-    _updi_application->chip_erase();
+    uint32_t retries_left = _retry_budget;
+    while (true) {
+        try {
+            _updi_application->chip_erase();
+            _page_cache.clear();
+            return;
+        } catch (const UpdiException& e) {
+            if (!recover_link(e, retries_left)) {
+                throw;
+            }
+        }
+    }
+}
+
+/*
+ * Tracks the progress of a page based operation and reports it
+ */
+class ProgressTracker {
+   public:
+    ProgressTracker(const ProgressCallback& callback,
+                    uint32_t                pages_total,
+                    uint32_t                page_size)
+        : _callback(callback),
+          _start(chrono::steady_clock::now()),
+          _pages_total(pages_total),
+          _pages_done(0),
+          _page_size(page_size) {
+    }
+
+    void page_done() {
+        _pages_done++;
+        if (!_callback) {
+            return;
+        }
+
+        auto elapsed_us = chrono::duration_cast<chrono::microseconds>(
+                              chrono::steady_clock::now() - _start)
+                              .count();
+
+        ProgressInfo info;
+        info.pages_done = _pages_done;
+        info.pages_total = _pages_total;
+        info.bytes_per_second =
+            elapsed_us ? (_pages_done * _page_size * 1e6 / elapsed_us) : 0;
+        info.eta_ms = (elapsed_us / 1000) * (_pages_total - _pages_done) /
+                      _pages_done;
+        _callback(info);
+    }
+
+   private:
+    const ProgressCallback&          _callback;
+    chrono::steady_clock::time_point _start;
+    uint32_t                         _pages_total;
+    uint32_t                         _pages_done;
+    uint32_t                         _page_size;
+};
+
+/*
+ * Silences the application step output for the scope of an operation
+ */
+class QuietGuard {
+   public:
+    QuietGuard(UpdiApplication& application, bool quiet)
+        : _application(application) {
+        _application.set_quiet(quiet);
+    }
+
+    ~QuietGuard() { _application.set_quiet(false); }
+
+   private:
+    UpdiApplication& _application;
+};
+
+void NvmProgrammer::write_flash(uint32_t                        address,
+                                const std::vector<ProgramPage>& pages,
+                                bool                            erase_pages) {
+    write_pages(address, pages, erase_pages, nullptr, CancellationToken());
 }
 
 void NvmProgrammer::write_flash(uint32_t                        address,
-                                const std::vector<ProgramPage>& pages) {
-    uint32_t page_start_addr = address;
+                                const std::vector<ProgramPage>& pages,
+                                const ProgressCallback&         progress,
+                                const CancellationToken&        cancel,
+                                bool                            erase_pages) {
+    write_pages(address, pages, erase_pages, progress, cancel);
+}
+
+future<void> NvmProgrammer::write_flash_async(
+    uint32_t                        address,
+    const std::vector<ProgramPage>& pages,
+    const ProgressCallback&         progress,
+    const CancellationToken&        cancel,
+    bool                            erase_pages) {
+    function<void()> operation = [=]() {
+        write_pages(address, pages, erase_pages, progress, cancel);
+    };
+    return executor().post(operation);
+}
+
+void NvmProgrammer::write_pages(uint32_t                        address,
+                                const std::vector<ProgramPage>& pages,
+                                bool                            erase_pages,
+                                const ProgressCallback&         progress,
+                                const CancellationToken&        cancel) {
+    uint32_t        page_start_addr = address;
+    ProgressTracker tracker(progress, pages.size(),
+                            _avr_device->get_flash_pagesize());
 
     if (!_programming) {
         throw UpdiException("Enter progmode first");
@@ -68,14 +281,180 @@ void NvmProgrammer::write_flash(uint32_t                        address,
         page_start_addr += _avr_device->get_flash_start_addr();
     }
 
-    for (auto page : pages) {
-        cout << "Write page at " << hex << page_start_addr << dec << endl;
-        _updi_application->write_nvm_page(page_start_addr, page.data);
-        page_start_addr += page.pageSize;
+    // The page steps are reported through the callback when one is set
+    QuietGuard quiet(*_updi_application, static_cast<bool>(progress));
+
+    for (auto& page : pages) {
+        if (cancel.is_cancelled()) {
+            throw UpdiCancelledException();
+        }
+        _deadline->check();
+
+        // Pages keep their distance to the first page, an image may have
+        // gaps
+        uint32_t page_addr =
+            page_start_addr + (page.address - pages.front().address);
+
+        if (!progress) {
+            cout << "Write page at " << hex << page_addr << dec << endl;
+        }
+
+        _page_cache.erase(page_addr);
+
+        // Every page gets the full retry budget
+        uint32_t retries_left = _retry_budget;
+        bool     retry = false;
+        while (true) {
+            try {
+                // A failed attempt may have left the page partially written,
+                // so retries erase it first
+                _updi_application->write_nvm_page(page_addr, page.data,
+                                                  page.pageSize,
+                                                  erase_pages || retry);
+                break;
+            } catch (const UpdiException& e) {
+                if (!recover_link(e, retries_left)) {
+                    throw;
+                }
+                retry = true;
+            }
+        }
+        tracker.page_done();
+    }
+}
+
+void NvmProgrammer::erase_flash(uint32_t address, uint32_t size) {
+    uint32_t page_start_addr = address;
+    uint32_t page_size = _avr_device->get_flash_pagesize();
+
+    if (!_programming) {
+        throw UpdiException("Enter progmode first");
+    }
+
+    if ((size % page_size)) {
+        throw UpdiException("Only full page aligned flash supported");
+    }
+
+    if (page_start_addr < _avr_device->get_flash_start_addr()) {
+        page_start_addr += _avr_device->get_flash_start_addr();
+    }
+
+    for (uint32_t i = 0; i < size / page_size; i++) {
+        cout << "Erase page at " << hex << page_start_addr << dec << endl;
+        _page_cache.erase(page_start_addr);
+
+        uint32_t retries_left = _retry_budget;
+        while (true) {
+            try {
+                _updi_application->erase_nvm_page(page_start_addr);
+                break;
+            } catch (const UpdiException& e) {
+                if (!recover_link(e, retries_left)) {
+                    throw;
+                }
+            }
+        }
+        page_start_addr += page_size;
+    }
+}
+
+bool NvmProgrammer::is_flash_blank() {
+    uint32_t     page_size = _avr_device->get_flash_pagesize();
+    uint32_t     page_count = _avr_device->get_flash_size() / page_size;
+    vector<bool> checked(page_count, false);
+
+    auto page_is_blank = [&](uint32_t page) {
+        checked[page] = true;
+        auto data = read_flash(
+            _avr_device->get_flash_start_addr() + page * page_size, page_size);
+        return all_of(data.begin(), data.end(),
+                      [](uint8_t b) { return b == 0xFF; });
+    };
+
+    // Sampled pages reject a programmed chip quickly
+    for (uint32_t page = 0; page < page_count; page += 16) {
+        if (!page_is_blank(page)) {
+            return false;
+        }
+    }
+
+    if (page_count > 0 && !page_is_blank(page_count - 1)) {
+        return false;
+    }
+
+    // Prove the rest
+    for (uint32_t page = 0; page < page_count; page++) {
+        if (!checked[page] && !page_is_blank(page)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+FlashRange NvmProgrammer::get_flash_section(FlashSection section) {
+    uint32_t   block_size = _avr_device->get_flash_section_blocksize();
+    uint32_t   flash_size = _avr_device->get_flash_size();
+    FlashRange range = {0, 0};
+
+    // Fuse 0x07 is APPEND (CODESIZE), fuse 0x08 is BOOTEND (BOOTSIZE)
+    auto     fuses = read_fuses();
+    uint32_t boot_end = min(fuses[0x08] * block_size, flash_size);
+    uint32_t app_end = min(fuses[0x07] * block_size, flash_size);
+
+    // BOOTEND 0 means the whole flash is BOOT section
+    if (boot_end == 0) {
+        boot_end = flash_size;
+    }
+
+    // APPEND 0 means APPCODE takes the rest of the flash
+    if (app_end == 0 || app_end < boot_end) {
+        app_end = flash_size;
     }
+
+    switch (section) {
+        case FLASH_SECTION_BOOT:
+            range.size = boot_end;
+            break;
+        case FLASH_SECTION_APPCODE:
+            range.offset = boot_end;
+            range.size = app_end - boot_end;
+            break;
+        case FLASH_SECTION_APPDATA:
+            range.offset = app_end;
+            range.size = flash_size - app_end;
+            break;
+    }
+
+    return range;
 }
 
 vector<uint8_t> NvmProgrammer::read_flash(uint32_t address, uint32_t size) {
+    return read_pages(address, size, nullptr, CancellationToken());
+}
+
+vector<uint8_t> NvmProgrammer::read_flash(uint32_t                 address,
+                                          uint32_t                 size,
+                                          const ProgressCallback&  progress,
+                                          const CancellationToken& cancel) {
+    return read_pages(address, size, progress, cancel);
+}
+
+future<vector<uint8_t>> NvmProgrammer::read_flash_async(
+    uint32_t                 address,
+    uint32_t                 size,
+    const ProgressCallback&  progress,
+    const CancellationToken& cancel) {
+    function<vector<uint8_t>()> operation = [=]() {
+        return read_pages(address, size, progress, cancel);
+    };
+    return executor().post(operation);
+}
+
+vector<uint8_t> NvmProgrammer::read_pages(uint32_t                 address,
+                                          uint32_t                 size,
+                                          const ProgressCallback&  progress,
+                                          const CancellationToken& cancel) {
     vector<uint8_t> flash_data;
     uint32_t        page_start_addr = address;
 
@@ -87,17 +466,85 @@ vector<uint8_t> NvmProgrammer::read_flash(uint32_t address, uint32_t size) {
         throw UpdiException("Only full page aligned flash supported");
     }
 
-    uint32_t page_count = size / _avr_device->get_flash_pagesize();
+    uint32_t        page_count = size / _avr_device->get_flash_pagesize();
+    ProgressTracker tracker(progress, page_count,
+                            _avr_device->get_flash_pagesize());
     for (uint32_t i = 0; i < page_count; i++) {
-        auto page_data = _updi_application->read_data_words(
-            page_start_addr, _avr_device->get_flash_pagesize() / 2);
+        if (cancel.is_cancelled()) {
+            throw UpdiCancelledException();
+        }
+        _deadline->check();
+
+        auto cached = _page_cache.find(page_start_addr);
+        if (cached != _page_cache.end()) {
+            _cache_stats.hits++;
+            flash_data.insert(flash_data.end(), cached->second.begin(),
+                              cached->second.end());
+            page_start_addr += _avr_device->get_flash_pagesize();
+            tracker.page_done();
+            continue;
+        }
+
+        vector<uint8_t> page_data;
+        uint32_t        retries_left = _retry_budget;
+        while (true) {
+            try {
+                page_data = _updi_application->read_data_words(
+                    page_start_addr, _avr_device->get_flash_pagesize() / 2);
+                break;
+            } catch (const UpdiException& e) {
+                if (!recover_link(e, retries_left)) {
+                    throw;
+                }
+            }
+        }
+        _cache_stats.misses++;
+        if (page_start_addr % _avr_device->get_flash_pagesize() == 0) {
+            _page_cache[page_start_addr] = page_data;
+        }
         flash_data.insert(flash_data.end(), page_data.begin(), page_data.end());
         page_start_addr += _avr_device->get_flash_pagesize();
+        tracker.page_done();
     }
 
     return flash_data;
 }
 
+vector<uint8_t> NvmProgrammer::read_memory(uint32_t address, uint32_t size) {
+    vector<uint8_t> data;
+
+    // Each burst is limited by the repeat counter
+    while (size > 0) {
+        uint32_t chunk = min(size, UPDI_MAX_REPEAT_SIZE);
+        auto     chunk_data = _updi_application->read_data(address, chunk);
+        data.insert(data.end(), chunk_data.begin(), chunk_data.end());
+        address += chunk;
+        size -= chunk;
+    }
+
+    return data;
+}
+
+uint32_t NvmProgrammer::read_signature() {
+    auto id = read_memory(_avr_device->get_sigrow_addr(), 3);
+
+    return (id[0] << 16) | (id[1] << 8) | id[2];
+}
+
+void NvmProgrammer::set_device(const std::string& device_name) {
+    *_avr_device = AvrDevice(device_name);
+    _page_cache.clear();
+}
+
+vector<uint8_t> NvmProgrammer::read_device_id() {
+    auto id = read_memory(_avr_device->get_sigrow_addr(), 3);
+    auto sernum = read_memory(_avr_device->get_sernum_addr(),
+                              _avr_device->get_sernum_size());
+
+    id.insert(id.end(), sernum.begin(), sernum.end());
+    return id;
+}
+
 uint8_t NvmProgrammer::read_fuse(uint32_t fuse_num) {
     if (!_programming) {
         throw UpdiException("Enter progmode first");
@@ -114,4 +561,167 @@ void NvmProgrammer::write_fuse(uint32_t fuse_num, uint8_t value) {
     _updi_application->write_fuse_data(fuse_num, value);
 }
 
-}  // namespace updi
\ No newline at end of file
+vector<uint8_t> NvmProgrammer::read_fuses() {
+    if (!_programming) {
+        throw UpdiException("Enter progmode first");
+    }
+
+    return _updi_application->read_data(_avr_device->get_fuses_addr(),
+                                        _avr_device->get_fuses_size());
+}
+
+uint32_t NvmProgrammer::apply_fuse_profile(const map<uint32_t, uint8_t>& fuses) {
+    uint32_t written = 0;
+
+    for (auto& fuse : fuses) {
+        if (fuse.first >= _avr_device->get_fuses_size()) {
+            throw UpdiException("Fuse offset out of range");
+        }
+    }
+
+    auto current = read_fuses();
+    for (auto& fuse : fuses) {
+        if (current[fuse.first] == fuse.second) {
+            continue;
+        }
+
+        cout << "Write fuse " << fuse.first << ": " << hex << setfill('0')
+             << "0x" << setw(2) << (int)current[fuse.first] << " -> 0x"
+             << setw(2) << (int)fuse.second << dec << setfill(' ') << endl;
+        _updi_application->write_fuse_data(fuse.first, fuse.second);
+        written++;
+    }
+
+    if (!written) {
+        cout << "Fuses already match the profile" << endl;
+        return 0;
+    }
+
+    // Read back all fuses at once for verification
+    current = read_fuses();
+    for (auto& fuse : fuses) {
+        if (current[fuse.first] != fuse.second) {
+            throw UpdiException("Fuse verification error");
+        }
+    }
+
+    return written;
+}
+
+uint32_t NvmProgrammer::write_eeprom(uint32_t               offset,
+                                     const vector<uint8_t>& data) {
+    return write_byte_pages("EEPROM", _avr_device->get_eeprom_addr(),
+                            _avr_device->get_eeprom_size(), offset, data);
+}
+
+uint32_t NvmProgrammer::write_user_row(uint32_t               offset,
+                                       const vector<uint8_t>& data) {
+    return write_byte_pages("User row", _avr_device->get_userrow_addr(),
+                            _avr_device->get_userrow_size(), offset, data);
+}
+
+uint32_t NvmProgrammer::write_byte_pages(const string&          memory,
+                                         uint32_t               base_addr,
+                                         uint32_t               memory_size,
+                                         uint32_t               offset,
+                                         const vector<uint8_t>& data) {
+    uint32_t page_size = _avr_device->get_eeprom_pagesize();
+    uint32_t written = 0;
+
+    if (!_programming) {
+        throw UpdiException("Enter progmode first");
+    }
+
+    if (offset + data.size() > memory_size) {
+        throw UpdiException(memory + " data out of range");
+    }
+
+    if (data.empty()) {
+        return 0;
+    }
+
+    // Only pages holding different bytes are written
+    auto current = read_memory(base_addr + offset, data.size());
+    for (uint32_t pos = 0; pos < data.size();) {
+        uint32_t address = offset + pos;
+        uint32_t chunk = min<uint32_t>(page_size - address % page_size,
+                                       data.size() - pos);
+        auto     first = data.begin() + pos;
+
+        if (!equal(first, first + chunk, current.begin() + pos)) {
+            _deadline->check();
+            cout << "Write " << memory << " at " << hex << address << dec
+                 << endl;
+            _updi_application->write_eeprom_page(
+                base_addr + address, vector<uint8_t>(first, first + chunk));
+            written++;
+        }
+        pos += chunk;
+    }
+
+    if (!written) {
+        cout << memory << " already matches the image" << endl;
+        return 0;
+    }
+
+    if (read_memory(base_addr + offset, data.size()) != data) {
+        throw UpdiException(memory + " verification error");
+    }
+
+    return written;
+}
+
+bool NvmProgrammer::recover_link(const UpdiException& error,
+                                 uint32_t&            retries_left) {
+    cerr << "UPDI error: " << error.what() << endl;
+
+    if (_deadline->expired()) {
+        return false;
+    }
+
+    while (retries_left > 0 && !_deadline->expired()) {
+        retries_left--;
+        _retry_stats.retries++;
+
+        try {
+            _updi_application->resync_link();
+            _retry_stats.link_resyncs++;
+
+            // NVMPROG normally survives a double break, re-enter it otherwise
+            if (!_updi_application->in_prog_mode()) {
+                cerr << "Programming mode lost, re-entering" << endl;
+                _updi_application->enter_progmode();
+                _retry_stats.progmode_reentries++;
+            }
+            return true;
+        } catch (const UpdiException& e) {
+            cerr << "Failed to recover UPDI link: " << e.what() << endl;
+        }
+    }
+
+    cerr << "Retry budget exhausted" << endl;
+    return false;
+}
+
+void NvmProgrammer::report_bringup() {
+    _bringup_ms = chrono::duration_cast<chrono::milliseconds>(
+                      chrono::steady_clock::now() - _session_start)
+                      .count();
+
+    cout << "Session ready in " << _bringup_ms << " ms (UPDI link "
+         << _updi_application->get_link_bringup_ms() << " ms"
+         << (_updi_application->link_needed_double_break()
+                 ? ", double break needed)"
+                 : ")")
+         << endl;
+}
+
+FlashExecutor& NvmProgrammer::executor() {
+    // Started on first use, most sessions never queue an operation
+    if (!_executor) {
+        _executor = make_unique<FlashExecutor>();
+    }
+    return *_executor;
+}
+
+}  // namespace updi
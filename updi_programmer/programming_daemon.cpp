@@ -0,0 +1,420 @@
+#include "programming_daemon.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include "fuse_profile.h"
+#include "programming_job.h"
+#include "updi_common.h"
+
+using namespace std;
+using namespace chrono;
+
+namespace updi {
+
+// Idle sessions are checked for a target every 5s
+constexpr uint32_t HEALTH_CHECK_INTERVAL_MS = 5000;
+
+// Longest accepted request line
+constexpr size_t MAX_REQUEST_SIZE = 4096;
+
+static void send_line(int client_fd, const string& line) {
+    string data = line + "\n";
+    send(client_fd, data.c_str(), data.size(), MSG_NOSIGNAL);
+}
+
+ProgrammingDaemon::ProgrammingDaemon(const string& socket_path,
+                                     const string& device_name,
+                                     uint32_t      baud_rate)
+    : _socket_path(socket_path),
+      _device_name(device_name),
+      _baud_rate(baud_rate),
+      _server_fd(-1),
+      _stopped(false),
+      _active_clients(0) {
+}
+
+ProgrammingDaemon::~ProgrammingDaemon() {
+    if (_server_fd >= 0) {
+        close(_server_fd);
+        unlink(_socket_path.c_str());
+    }
+}
+
+void ProgrammingDaemon::run() {
+    struct sockaddr_un addr;
+
+    if (_socket_path.size() >= sizeof(addr.sun_path)) {
+        throw runtime_error("Socket path too long");
+    }
+
+    _server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_server_fd < 0) {
+        throw runtime_error(string("Failed to create socket: ") +
+                            strerror(errno));
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, _socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    unlink(_socket_path.c_str());
+    if (bind(_server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(_server_fd, 8) < 0) {
+        throw runtime_error(string("Failed to listen on ") + _socket_path +
+                            ": " + strerror(errno));
+    }
+
+    cout << "Listening on " << _socket_path << endl;
+
+    while (!_stopped) {
+        struct pollfd pfd = {_server_fd, POLLIN, 0};
+        int           ret = poll(&pfd, 1, 1000);
+
+        if (ret > 0 && (pfd.revents & POLLIN)) {
+            int client_fd = accept(_server_fd, nullptr, nullptr);
+            if (client_fd >= 0) {
+                _active_clients++;
+                thread(&ProgrammingDaemon::serve_client, this, client_fd)
+                    .detach();
+            }
+        } else if (ret == 0) {
+            check_idle_sessions();
+        }
+    }
+
+    // Let running jobs finish before the sessions are closed
+    while (_active_clients > 0) {
+        this_thread::sleep_for(milliseconds(100));
+    }
+    close_sessions();
+}
+
+void ProgrammingDaemon::serve_client(int client_fd) {
+    string buffer;
+    char   chunk[512];
+
+    while (!_stopped) {
+        struct pollfd pfd = {client_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+
+        ssize_t n = recv(client_fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            break;
+        }
+        buffer.append(chunk, n);
+
+        size_t eol;
+        while ((eol = buffer.find('\n')) != string::npos) {
+            string request = buffer.substr(0, eol);
+            buffer.erase(0, eol + 1);
+            if (!request.empty() && request.back() == '\r') {
+                request.pop_back();
+            }
+            if (!request.empty()) {
+                handle_request(client_fd, request);
+            }
+        }
+
+        if (buffer.size() > MAX_REQUEST_SIZE) {
+            send_line(client_fd, "error request too long");
+            break;
+        }
+    }
+
+    close(client_fd);
+    _active_clients--;
+}
+
+void ProgrammingDaemon::handle_request(int client_fd, const string& request) {
+    stringstream ss(request);
+    string       command;
+    string       token;
+    Arguments    args;
+
+    ss >> command;
+    while (ss >> token) {
+        size_t separator = token.find('=');
+        if (separator == string::npos) {
+            send_line(client_fd, "error invalid argument " + token);
+            return;
+        }
+        args[token.substr(0, separator)] = token.substr(separator + 1);
+    }
+
+    if (command == "ping") {
+        send_line(client_fd, "ok");
+        return;
+    }
+
+    auto port = args.find("port");
+    if (port == args.end()) {
+        send_line(client_fd, "error port is required");
+        return;
+    }
+
+    auto                   session = get_session(port->second);
+    lock_guard<std::mutex> guard(session->lock);
+
+    if (command == "close") {
+        if (session->nvm) {
+            // The target may be gone already, the port is released anyway
+            try {
+                session->nvm->leave_progmode();
+            } catch (const UpdiException& e) {
+                session->nvm.reset();
+                send_line(client_fd, string("error ") + e.what());
+                return;
+            }
+            session->nvm.reset();
+        }
+        send_line(client_fd, "ok");
+        return;
+    }
+
+    run_job(client_fd, command, args, *session);
+    session->last_used = steady_clock::now();
+}
+
+void ProgrammingDaemon::run_job(int              client_fd,
+                                const string&    command,
+                                const Arguments& args,
+                                Session&         session) {
+    auto arg = [&args](const string& key) {
+        auto it = args.find(key);
+        return it == args.end() ? string() : it->second;
+    };
+
+    string   port = arg("port");
+    string   device_name = _device_name;
+    uint32_t baud_rate = _baud_rate;
+    auto     start = steady_clock::now();
+
+    if (!arg("device").empty()) {
+        device_name = arg("device");
+    }
+
+    try {
+        stringstream   details;
+        ProgrammingJob job;
+
+        if (!arg("baud").empty()) {
+            baud_rate = stoul(arg("baud"), nullptr, 0);
+        }
+
+        if (command == "flash" || command == "verify") {
+            AvrDevice device(device_name);
+            job.set_image(load_image(arg("file"), device));
+            job.set_verify_only(command == "verify");
+            job.set_blank_check(arg("blankcheck") == "1");
+
+            if (arg("section") == "boot") {
+                job.set_section(FLASH_SECTION_BOOT);
+            } else if (arg("section") == "appcode") {
+                job.set_section(FLASH_SECTION_APPCODE);
+            } else if (arg("section") == "appdata") {
+                job.set_section(FLASH_SECTION_APPDATA);
+            } else if (!arg("section").empty()) {
+                throw invalid_argument("unknown section " + arg("section"));
+            }
+        } else if (command != "fuses" && command != "dump") {
+            throw invalid_argument("unknown command " + command);
+        }
+
+        if (!arg("fuses").empty() || !arg("fusefile").empty()) {
+            FuseProfile profile;
+            if (!arg("fusefile").empty()) {
+                profile.load_file(arg("fusefile"));
+            }
+            profile.load_string(arg("fuses"));
+            job.set_fuse_profile(profile.get_fuses());
+        }
+
+        job.set_progress_callback([client_fd](const ProgressInfo& info) {
+            stringstream ss;
+            ss << "progress " << info.pages_done << "/" << info.pages_total
+               << " " << (uint32_t)info.bytes_per_second << " "
+               << info.eta_ms;
+            send_line(client_fd, ss.str());
+        });
+
+        // Reuse the warm session if it is still attached
+        bool reuse = session.nvm && session.device_name == device_name &&
+                     session.baud_rate == baud_rate &&
+                     session.nvm->is_session_alive();
+        if (!reuse) {
+            open_session(session, port, device_name, baud_rate,
+                         command == "flash");
+        }
+
+        DeadlineGuard deadline_guard(*session.nvm);
+        if (!arg("timeout").empty()) {
+            session.nvm->set_deadline(stoul(arg("timeout"), nullptr, 0));
+        }
+
+        if (command == "dump") {
+            uint32_t address = stoul(arg("address"), nullptr, 0);
+            uint32_t size = stoul(arg("size"), nullptr, 0);
+            auto     data = session.nvm->read_memory(address, size);
+
+            for (size_t i = 0; i < data.size(); i += 32) {
+                stringstream line;
+                line << "data" << hex << setfill('0');
+                for (size_t n = i; n < min(data.size(), i + 32); n++) {
+                    line << ' ' << setw(2) << (int)data[n];
+                }
+                send_line(client_fd, line.str());
+            }
+        } else {
+            JobReport report = job.run(*session.nvm);
+            details << " pages=" << report.pages_written
+                    << " fuses=" << report.fuses_written
+                    << " erase_skipped=" << report.erase_skipped;
+        }
+
+        details << " warm=" << reuse
+                << " cache_hits=" << session.nvm->get_cache_stats().hits
+                << " ms="
+                << duration_cast<milliseconds>(steady_clock::now() - start)
+                       .count();
+        send_line(client_fd, "ok" + details.str());
+    } catch (const UpdiException& e) {
+        // The link state is unknown, start from scratch next time
+        session.nvm.reset();
+        send_line(client_fd, string("error ") + e.what());
+    } catch (const exception& e) {
+        send_line(client_fd, string("error ") + e.what());
+    }
+}
+
+shared_ptr<ProgrammingDaemon::Session> ProgrammingDaemon::get_session(
+    const string& port) {
+    lock_guard<std::mutex> guard(_sessions_lock);
+
+    auto& session = _sessions[port];
+    if (!session) {
+        session = make_shared<Session>();
+        session->baud_rate = 0;
+        session->last_used = steady_clock::now();
+    }
+
+    return session;
+}
+
+void ProgrammingDaemon::open_session(Session&      session,
+                                     const string& port,
+                                     const string& device_name,
+                                     uint32_t      baud_rate,
+                                     bool          unlock) {
+    // Closing the old programmer releases the port first
+    session.nvm.reset();
+    session.nvm = make_unique<NvmProgrammer>(port, baud_rate, device_name);
+    session.device_name = device_name;
+    session.baud_rate = baud_rate;
+
+    session.nvm->get_device_info();
+    try {
+        session.nvm->enter_progmode();
+    } catch (const UpdiDeadlineException& e) {
+        throw;
+    } catch (const UpdiException& e) {
+        // Unlocking erases the chip, only done for flash jobs
+        if (!unlock) {
+            throw;
+        }
+        session.nvm->unlock_device();
+    }
+}
+
+shared_ptr<const IntelHexFile> ProgrammingDaemon::load_image(
+    const string& filename,
+    AvrDevice&    device) {
+    struct stat st;
+
+    if (filename.empty() || stat(filename.c_str(), &st) != 0) {
+        throw invalid_argument("cannot access file " + filename);
+    }
+
+    // Parsed images are reused until the file changes
+    string key = filename + "@" + to_string(device.get_flash_size()) + "/" +
+                 to_string(device.get_flash_pagesize());
+    lock_guard<std::mutex> guard(_images_lock);
+
+    auto it = _images.find(key);
+    if (it != _images.end() && it->second.mtime == st.st_mtime) {
+        return it->second.image;
+    }
+
+    auto ihex = make_shared<IntelHexFile>(device.get_flash_size(),
+                                          device.get_flash_pagesize());
+    ihex->load_file(filename);
+
+    CachedImage cached = {ihex, st.st_mtime};
+    _images[key] = cached;
+    return ihex;
+}
+
+void ProgrammingDaemon::check_idle_sessions() {
+    vector<pair<string, shared_ptr<Session>>> sessions;
+    {
+        // Probing a dead target takes up to a read timeout, requests must
+        // not wait for the map meanwhile
+        lock_guard<std::mutex> guard(_sessions_lock);
+        sessions.assign(_sessions.begin(), _sessions.end());
+    }
+
+    // Sessions stay in the map, clients may hold them already. Only the
+    // programmer is closed, it is reopened by the next job on the port
+    auto now = steady_clock::now();
+    for (auto& entry : sessions) {
+        auto& session = entry.second;
+
+        // Busy sessions are skipped
+        unique_lock<std::mutex> session_guard(session->lock, try_to_lock);
+        if (!session_guard.owns_lock() || !session->nvm ||
+            duration_cast<milliseconds>(now - session->last_used).count() <
+                HEALTH_CHECK_INTERVAL_MS) {
+            continue;
+        }
+
+        session->last_used = now;
+        if (!session->nvm->is_session_alive()) {
+            cout << "Target on " << entry.first << " is gone, close session"
+                 << endl;
+            session->nvm.reset();
+        }
+    }
+}
+
+void ProgrammingDaemon::close_sessions() {
+    lock_guard<std::mutex> guard(_sessions_lock);
+
+    for (auto& entry : _sessions) {
+        lock_guard<std::mutex> session_guard(entry.second->lock);
+        if (entry.second->nvm) {
+            try {
+                entry.second->nvm->leave_progmode();
+            } catch (const UpdiException& e) {
+                cerr << "Failed to close session on " << entry.first << ": "
+                     << e.what() << endl;
+            }
+            entry.second->nvm.reset();
+        }
+    }
+    _sessions.clear();
+}
+
+}  // namespace updi
@@ -0,0 +1,324 @@
+#include "programming_image.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "programming_plan.h"
+
+using namespace std;
+
+namespace updi {
+
+constexpr char     IMAGE_MAGIC[8] = {'U', 'P', 'D', 'I', 'I', 'M', 'G', 0};
+constexpr uint32_t IMAGE_VERSION = 2;
+
+// Header: magic(8) version(4) flash size(4) page size(4) page count(4)
+// region count(4) data offset(4) device name(32)
+constexpr size_t HEADER_SIZE = 64;
+constexpr size_t HEADER_VERSION = 8;
+constexpr size_t HEADER_FLASH_SIZE = 12;
+constexpr size_t HEADER_PAGE_SIZE = 16;
+constexpr size_t HEADER_PAGE_COUNT = 20;
+constexpr size_t HEADER_REGION_COUNT = 24;
+constexpr size_t HEADER_DATA_OFFSET = 28;
+constexpr size_t HEADER_DEVICE_NAME = 32;
+constexpr size_t DEVICE_NAME_SIZE = 32;
+
+// Page entry: flash offset(4) reserved(4) page hash(8)
+constexpr size_t PAGE_ENTRY_SIZE = 16;
+
+// Region entry: memory(4) address(4) size(4) file offset(4)
+constexpr size_t   REGION_ENTRY_SIZE = 16;
+constexpr uint32_t REGION_EEPROM = 1;
+constexpr uint32_t REGION_USER_ROW = 2;
+constexpr uint32_t REGION_FUSES = 3;
+
+// Page data starts on a memory page of the station host
+constexpr size_t DATA_ALIGNMENT = 4096;
+
+static uint32_t read_le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read_le64(const uint8_t* p) {
+    return read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+static void put_le32(uint8_t* p, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static void append_le(vector<uint8_t>& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out.push_back(value >> (8 * i));
+    }
+}
+
+static void append_region(vector<uint8_t>&    table,
+                          vector<uint8_t>&    region_data,
+                          uint32_t            memory,
+                          const ImageSegment& segment) {
+    append_le(table, memory, 4);
+    append_le(table, segment.address, 4);
+    append_le(table, segment.data.size(), 4);
+    append_le(table, region_data.size(), 4);  // relative, fixed up later
+    region_data.insert(region_data.end(), segment.data.begin(),
+                       segment.data.end());
+}
+
+static void throw_error(const string& name, const string& message) {
+    string error = name + ": " + message;
+    cerr << error << endl;
+    throw ios_base::failure(error);
+}
+
+ProgrammingImage::ProgrammingImage(uint32_t flash_size, uint32_t page_size)
+    : nvm_flash_size(flash_size),
+      nvm_page_size(page_size),
+      mapping(MAP_FAILED),
+      mapping_size(0) {
+}
+
+ProgrammingImage::~ProgrammingImage() {
+    unmap();
+}
+
+bool ProgrammingImage::is_image_file(const string& filename) {
+    char magic[sizeof(IMAGE_MAGIC)];
+    int  fd = open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool image = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                 memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0;
+    close(fd);
+    return image;
+}
+
+void ProgrammingImage::write_file(const string&                 filename,
+                                  AvrDevice&                    device,
+                                  const IntelHexFile&           flash,
+                                  const vector<ImageSegment>&   eeprom,
+                                  const vector<ImageSegment>&   user_row,
+                                  const map<uint32_t, uint8_t>& fuses) {
+    auto&           flash_pages = flash.get_page_data();
+    vector<uint8_t> out(HEADER_SIZE, 0);
+    vector<uint8_t> regions;
+    vector<uint8_t> region_data;
+    uint32_t        region_count = 0;
+
+    for (auto& page : flash_pages) {
+        append_le(out, page.address, 4);
+        append_le(out, 0, 4);
+        append_le(out, ProgrammingPlan::page_hash(page.data, page.pageSize),
+                  8);
+    }
+
+    for (auto& segment : eeprom) {
+        append_region(regions, region_data, REGION_EEPROM, segment);
+        region_count++;
+    }
+    for (auto& segment : user_row) {
+        append_region(regions, region_data, REGION_USER_ROW, segment);
+        region_count++;
+    }
+
+    // Fuses are stored as runs of consecutive offsets
+    for (auto it = fuses.begin(); it != fuses.end();) {
+        ImageSegment run;
+        run.address = it->first;
+        do {
+            run.data.push_back(it->second);
+            it++;
+        } while (it != fuses.end() &&
+                 it->first == run.address + run.data.size());
+        append_region(regions, region_data, REGION_FUSES, run);
+        region_count++;
+    }
+
+    // Region data follows the region table
+    size_t region_data_offset = out.size() + regions.size();
+    for (uint32_t n = 0; n < region_count; n++) {
+        uint8_t* entry = &regions[n * REGION_ENTRY_SIZE + 12];
+        put_le32(entry, read_le32(entry) + region_data_offset);
+    }
+    out.insert(out.end(), regions.begin(), regions.end());
+    out.insert(out.end(), region_data.begin(), region_data.end());
+    out.resize((out.size() + DATA_ALIGNMENT - 1) & ~(DATA_ALIGNMENT - 1));
+
+    memcpy(&out[0], IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    put_le32(&out[HEADER_VERSION], IMAGE_VERSION);
+    put_le32(&out[HEADER_FLASH_SIZE], device.get_flash_size());
+    put_le32(&out[HEADER_PAGE_SIZE], device.get_flash_pagesize());
+    put_le32(&out[HEADER_PAGE_COUNT], flash_pages.size());
+    put_le32(&out[HEADER_REGION_COUNT], region_count);
+    put_le32(&out[HEADER_DATA_OFFSET], out.size());
+    strncpy((char*)&out[HEADER_DEVICE_NAME], device.get_name().c_str(),
+            DEVICE_NAME_SIZE - 1);
+
+    ofstream file(filename.c_str(), ios::out | ios::trunc | ios::binary);
+    file.write((const char*)out.data(), out.size());
+    for (auto& page : flash_pages) {
+        file.write((const char*)page.data, page.pageSize);
+    }
+    file.close();
+
+    if (!file) {
+        stringstream ss;
+        ss << "failed to write file " << filename;
+        throw ios_base::failure(ss.str());
+    }
+
+    cout << "Image for " << device.get_name() << ": " << flash_pages.size()
+         << " pages, " << region_count << " regions" << endl;
+}
+
+void ProgrammingImage::load_file(const string& filename) {
+    unmap();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        stringstream ss;
+        ss << "failed to open file " << filename;
+        throw ios_base::failure(ss.str());
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        mapping_size = st.st_size;
+    }
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        stringstream ss;
+        ss << "failed to map file " << filename;
+        throw ios_base::failure(ss.str());
+    }
+
+    try {
+        parse(filename);
+    } catch (...) {
+        unmap();
+        throw;
+    }
+}
+
+void ProgrammingImage::parse(const string& name) {
+    const uint8_t* data = (const uint8_t*)mapping;
+    size_t         size = mapping_size;
+
+    if (size < HEADER_SIZE ||
+        memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0) {
+        throw_error(name, "not a programming image");
+    }
+    if (read_le32(data + HEADER_VERSION) != IMAGE_VERSION) {
+        throw_error(name, "unsupported programming image version");
+    }
+    if (read_le32(data + HEADER_FLASH_SIZE) != nvm_flash_size ||
+        read_le32(data + HEADER_PAGE_SIZE) != nvm_page_size) {
+        throw_error(name, "image is built for another flash geometry");
+    }
+
+    uint32_t page_count = read_le32(data + HEADER_PAGE_COUNT);
+    uint32_t region_count = read_le32(data + HEADER_REGION_COUNT);
+    uint32_t data_offset = read_le32(data + HEADER_DATA_OFFSET);
+    uint64_t region_offset =
+        HEADER_SIZE + (uint64_t)page_count * PAGE_ENTRY_SIZE;
+
+    if (region_offset + (uint64_t)region_count * REGION_ENTRY_SIZE > size ||
+        data_offset + (uint64_t)page_count * nvm_page_size > size) {
+        throw_error(name, "programming image is truncated");
+    }
+
+    const char* device = (const char*)data + HEADER_DEVICE_NAME;
+    device_name.assign(device, strnlen(device, DEVICE_NAME_SIZE));
+
+    // The page data stays in the mapping. The plan skips pages by their
+    // hash, so every hash is checked against its page: a stale hash could
+    // leave a page unwritten, and only written pages are verified
+    for (uint32_t n = 0; n < page_count; n++) {
+        const uint8_t* entry = data + HEADER_SIZE + n * PAGE_ENTRY_SIZE;
+        ProgramPage    page;
+
+        page.address = read_le32(entry);
+        page.pageSize = nvm_page_size;
+        page.data = data + data_offset + (size_t)n * nvm_page_size;
+        if (page.address % nvm_page_size ||
+            page.address + nvm_page_size > nvm_flash_size ||
+            (!pages.empty() && page.address <= pages.back().address)) {
+            stringstream ss;
+            ss << "invalid page at 0x" << hex << page.address;
+            throw_error(name, ss.str());
+        }
+
+        uint64_t hash = read_le64(entry + 8);
+        if (ProgrammingPlan::page_hash(page.data, nvm_page_size) != hash) {
+            stringstream ss;
+            ss << "page at 0x" << hex << page.address
+               << " doesn't match its hash";
+            throw_error(name, ss.str());
+        }
+
+        pages.push_back(page);
+        page_hashes.push_back(hash);
+    }
+
+    for (uint32_t n = 0; n < region_count; n++) {
+        const uint8_t* entry = data + region_offset + n * REGION_ENTRY_SIZE;
+        uint32_t       memory = read_le32(entry);
+        uint32_t       length = read_le32(entry + 8);
+        uint32_t       offset = read_le32(entry + 12);
+        ImageSegment   segment;
+
+        if ((uint64_t)offset + length > size) {
+            throw_error(name, "programming image is truncated");
+        }
+        segment.address = read_le32(entry + 4);
+        segment.data.assign(data + offset, data + offset + length);
+
+        if (memory == REGION_EEPROM) {
+            eeprom.push_back(move(segment));
+        } else if (memory == REGION_USER_ROW) {
+            user_row.push_back(move(segment));
+        } else if (memory == REGION_FUSES) {
+            for (uint32_t i = 0; i < length; i++) {
+                fuses[segment.address + i] = segment.data[i];
+            }
+        } else {
+            throw_error(name, "unknown memory region");
+        }
+    }
+
+    madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+    cout << "Image for " << device_name << ": " << pages.size()
+         << " pages mapped" << endl;
+}
+
+void ProgrammingImage::unmap() {
+    if (mapping != MAP_FAILED) {
+        munmap(mapping, mapping_size);
+    }
+
+    mapping = MAP_FAILED;
+    mapping_size = 0;
+    device_name.clear();
+    pages.clear();
+    page_hashes.clear();
+    eeprom.clear();
+    user_row.clear();
+    fuses.clear();
+}
+
+}  // namespace updi
@@ -0,0 +1,575 @@
+#include "programming_job.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "spsc_queue.h"
+#include "updi_common.h"
+
+using namespace std;
+using namespace chrono;
+
+namespace updi {
+
+// Pages written between two verify reads when journaling
+constexpr uint32_t JOURNAL_BATCH_PAGES = 16;
+
+// Pages held between the stream parser and the wire, parsing is far ahead
+// of the wire anyway
+constexpr size_t STREAM_QUEUE_PAGES = 16;
+
+// A streamed page, the buffer circulates between parser and writer
+struct StreamPage {
+    uint32_t        address;
+    vector<uint8_t> data;
+};
+
+static const char* section_name(FlashSection section) {
+    switch (section) {
+        case FLASH_SECTION_BOOT:
+            return "boot";
+        case FLASH_SECTION_APPCODE:
+            return "appcode";
+        case FLASH_SECTION_APPDATA:
+            return "appdata";
+    }
+    return "";
+}
+
+ProgrammingJob::ProgrammingJob()
+    : _use_section(false),
+      _section(FLASH_SECTION_APPCODE),
+      _blank_check(false),
+      _verify_only(false) {
+}
+
+ProgrammingJob::~ProgrammingJob() {
+}
+
+void ProgrammingJob::set_image(const shared_ptr<const IntelHexFile>& image) {
+    // The page list shares the lifetime of the image
+    _pages = image ? shared_ptr<const vector<ProgramPage>>(
+                         image, &image->get_page_data())
+                   : nullptr;
+    _page_hashes = nullptr;
+}
+
+void ProgrammingJob::set_image(
+    const shared_ptr<const ProgrammingImage>& image) {
+    _pages = image ? shared_ptr<const vector<ProgramPage>>(
+                         image, &image->get_page_data())
+                   : nullptr;
+    _page_hashes = image ? shared_ptr<const vector<uint64_t>>(
+                               image, &image->get_page_hashes())
+                         : nullptr;
+}
+
+void ProgrammingJob::set_section(FlashSection section) {
+    _use_section = true;
+    _section = section;
+}
+
+JobReport ProgrammingJob::run(NvmProgrammer& nvm) const {
+    JobReport report = {false, 0, 0};
+
+    if (_verify_only) {
+        if (_pages) {
+            verify_pages(nvm, *_pages);
+        }
+        verify_byte_memories(nvm);
+        if (_pages || !_eeprom.empty() || !_user_row.empty()) {
+            cout << "Verification successful" << endl;
+        }
+    } else if (!_stream.empty()) {
+        flash_stream(nvm, report);
+        cout << "Programming successful" << endl;
+    } else if (_pages) {
+        const vector<ProgramPage>* pages = _pages.get();
+        vector<ProgramPage>        unit_pages;
+        vector<ProgramPage>        extra_pages;
+        vector<uint8_t>            unit_data;
+
+        if (_serializer) {
+            UnitSerializer::patch_pages(*pages, _serializer->next_unit(),
+                                        nvm.get_device()->get_flash_pagesize(),
+                                        unit_pages, extra_pages, unit_data);
+            pages = &unit_pages;
+        }
+
+        if (_use_section) {
+            flash_section(nvm, *pages, report);
+        } else {
+            flash(nvm, *pages, report);
+        }
+        write_extra_pages(nvm, extra_pages);
+        cout << "Programming successful" << endl;
+    }
+
+    if (!_verify_only) {
+        write_byte_memories(nvm);
+    }
+
+    if (!_fuses.empty()) {
+        report.fuses_written = nvm.apply_fuse_profile(_fuses);
+        cout << report.fuses_written << " of " << _fuses.size()
+             << " fuses written" << endl;
+    }
+
+    return report;
+}
+
+void ProgrammingJob::flash(NvmProgrammer&             nvm,
+                           const vector<ProgramPage>& pages,
+                           JobReport&                 report) const {
+    FlashJournal journal(_journal);
+    bool         resume = false;
+
+    if (!_journal.empty()) {
+        resume = journal.open(FlashJournal::image_hash(pages),
+                              nvm.read_device_id());
+    }
+
+    if (resume) {
+        // The flash was erased by the interrupted run
+        cout << "Resume from journal: " << journal.get_completed_count()
+             << " of " << pages.size() << " pages already verified" << endl;
+        report.erase_skipped = true;
+    } else if (_blank_check) {
+        auto start = steady_clock::now();
+        bool blank = nvm.is_flash_blank();
+        auto elapsed =
+            duration_cast<milliseconds>(steady_clock::now() - start).count();
+
+        cout << "Blank check: flash is "
+             << (blank ? "blank, chip erase skipped"
+                       : "not blank, chip erase required")
+             << " (" << elapsed << " ms)" << endl;
+        report.erase_skipped = blank;
+    }
+
+    if (_journal.empty()) {
+        // A blank unit is known to hold nothing but erased pages
+        map<uint32_t, uint64_t> state;
+        auto                    device = nvm.get_device();
+        if (report.erase_skipped) {
+            state = ProgrammingPlan::image_state(
+                vector<ProgramPage>(), device->get_flash_size(),
+                device->get_flash_pagesize());
+        }
+
+        // Patched unit pages don't match the precomputed hashes
+        ProgrammingPlan plan;
+        plan.set_device_state(state);
+        plan.build(*device, nvm.get_baud_rate(), pages,
+                   &pages == _pages.get() ? _page_hashes.get() : nullptr);
+        cout << "Plan: "
+             << (plan.get_erase_strategy() == ERASE_STRATEGY_CHIP
+                     ? "chip erase"
+                     : "page erase-write")
+             << ", " << plan.get_write_pages().size() << " pages to write, "
+             << plan.get_skipped_count() << " skipped (estimated "
+             << plan.get_estimate().total_ms << " ms)" << endl;
+
+        if (plan.get_erase_strategy() == ERASE_STRATEGY_CHIP) {
+            nvm.chip_erase();
+        }
+        report.erase_skipped =
+            plan.get_erase_strategy() != ERASE_STRATEGY_CHIP;
+        report.pages_written = plan.get_write_pages().size();
+        write_planned(nvm, pages, plan);
+        return;
+    }
+
+    if (!report.erase_skipped) {
+        nvm.chip_erase();
+    }
+
+    // The page in flight when the run was interrupted may be partially
+    // written, so resumed pages are erase-written
+    report.pages_written = pages.size() - journal.get_completed_count();
+    write_journaled(nvm, pages, journal, resume);
+
+    // Read out pages of flash again
+    // This is to verify if flashing is successful
+    verify_pages(nvm, pages);
+    journal.finish();
+}
+
+void ProgrammingJob::flash_stream(NvmProgrammer& nvm,
+                                  JobReport&     report) const {
+    auto     device = nvm.get_device();
+    uint32_t page_size = device->get_flash_pagesize();
+
+    // Nothing is known about the image up front, so the whole chip is erased
+    if (_blank_check && nvm.is_flash_blank()) {
+        cout << "Blank check: flash is blank, chip erase skipped" << endl;
+        report.erase_skipped = true;
+    } else {
+        nvm.chip_erase();
+    }
+
+    SpscQueue<StreamPage> queue(STREAM_QUEUE_PAGES);
+    exception_ptr         parse_error;
+    uint32_t              flash_size = device->get_flash_size();
+
+    thread parser([&]() {
+        IntelHexFile ihex(flash_size, page_size);
+        StreamPage   slot;
+
+        try {
+            ihex.load_stream(_stream, [&](const ProgramPage& page) {
+                slot.address = page.address;
+                slot.data.assign(page.data, page.data + page.pageSize);
+                return queue.push(slot);
+            });
+        } catch (...) {
+            parse_error = current_exception();
+        }
+        queue.close();
+    });
+
+    // Pages already queued are written in one go, the hashes are kept for
+    // verification instead of the data
+    map<uint32_t, uint64_t> page_hashes;
+    vector<StreamPage>      batch(STREAM_QUEUE_PAGES);
+    vector<ProgramPage>     pages;
+    try {
+        while (queue.pop(batch[0])) {
+            size_t count = 1;
+            while (count < batch.size() && queue.try_pop(batch[count])) {
+                count++;
+            }
+
+            pages.clear();
+            for (size_t n = 0; n < count; n++) {
+                auto& page = batch[n];
+                if (all_of(page.data.begin(), page.data.end(),
+                           [](uint8_t b) { return b == 0xFF; })) {
+                    continue;  // erased already
+                }
+                pages.push_back(
+                    ProgramPage{page.address, page_size, page.data.data()});
+                page_hashes[page.address] =
+                    ProgrammingPlan::page_hash(page.data.data(), page_size);
+            }
+
+            if (!pages.empty()) {
+                write_pages(nvm, pages, false);
+            }
+        }
+    } catch (...) {
+        queue.cancel();
+        parser.join();
+        throw;
+    }
+
+    parser.join();
+    if (parse_error) {
+        rethrow_exception(parse_error);
+    }
+
+    report.pages_written = page_hashes.size();
+    verify_hashes(nvm, page_hashes);
+}
+
+ProgrammingPlan ProgrammingJob::make_plan(
+    AvrDevice&                     device,
+    uint32_t                       baud_rate,
+    const map<uint32_t, uint64_t>& state) const {
+    ProgrammingPlan plan;
+
+    plan.set_device_state(state);
+    plan.build(device, baud_rate, _pages ? *_pages : vector<ProgramPage>(),
+               _page_hashes.get());
+    return plan;
+}
+
+void ProgrammingJob::write_planned(NvmProgrammer&             nvm,
+                                   const vector<ProgramPage>& pages,
+                                   const ProgrammingPlan&     plan) const {
+    uint32_t            page_size = nvm.get_device()->get_flash_pagesize();
+    vector<ProgramPage> write_only;
+    vector<ProgramPage> erase_write;
+
+    for (auto index : plan.get_write_pages()) {
+        if (plan.needs_erase(index)) {
+            erase_write.push_back(pages[index]);
+        } else {
+            write_only.push_back(pages[index]);
+        }
+    }
+
+    if (!write_only.empty()) {
+        write_pages(nvm, write_only, false);
+    }
+    if (!erase_write.empty()) {
+        write_pages(nvm, erase_write, true);
+    }
+
+    // Leftovers outside the image, so the unit ends up as after a chip
+    // erase
+    auto& erase_pages = plan.get_erase_pages();
+    for (size_t n = 0; n < erase_pages.size();) {
+        size_t last = n;
+        while (last + 1 < erase_pages.size() &&
+               erase_pages[last + 1] == erase_pages[last] + page_size) {
+            last++;
+        }
+        nvm.erase_flash(erase_pages[n], (last - n + 1) * page_size);
+        n = last + 1;
+    }
+
+    // Read out pages of flash again
+    // This is to verify if flashing is successful
+    verify_pages(nvm, write_only);
+    verify_pages(nvm, erase_write);
+}
+
+void ProgrammingJob::write_journaled(NvmProgrammer&             nvm,
+                                     const vector<ProgramPage>& pages,
+                                     FlashJournal&              journal,
+                                     bool erase_pages) const {
+    vector<ProgramPage> batch;
+
+    auto flush_batch = [&]() {
+        if (batch.empty()) {
+            return;
+        }
+
+        write_pages(nvm, batch, erase_pages);
+        verify_pages(nvm, batch);
+        for (auto& page : batch) {
+            journal.record(page.address);
+        }
+        journal.sync();
+        batch.clear();
+    };
+
+    // Incomplete pages are written in batches, each batch is verified
+    // before it is recorded
+    for (auto& page : pages) {
+        if (journal.is_completed(page.address)) {
+            flush_batch();
+            continue;
+        }
+
+        batch.push_back(page);
+        if (batch.size() == JOURNAL_BATCH_PAGES) {
+            flush_batch();
+        }
+    }
+    flush_batch();
+}
+
+void ProgrammingJob::flash_section(NvmProgrammer&             nvm,
+                                   const vector<ProgramPage>& image_pages,
+                                   JobReport&                 report) const {
+    auto       device = nvm.get_device();
+    uint32_t   page_size = device->get_flash_pagesize();
+    FlashRange range = nvm.get_flash_section(_section);
+
+    if (range.size == 0) {
+        throw UpdiException(string("Flash section ") + section_name(_section) +
+                            " is empty");
+    }
+
+    cout << "Flash section " << section_name(_section) << ": 0x" << hex
+         << range.offset << " - 0x" << range.offset + range.size << dec
+         << endl;
+
+    // Only pages inside the section are written, everything else on the
+    // chip is kept intact
+    vector<ProgramPage> pages;
+    uint32_t            skipped = 0;
+    for (auto& page : image_pages) {
+        if (page.address >= range.offset &&
+            page.address + page.pageSize <= range.offset + range.size) {
+            pages.push_back(page);
+            continue;
+        }
+
+        // The image only holds pages with data, whatever their content
+        skipped++;
+        cerr << "Image data at 0x" << hex << page.address << dec
+             << " is outside the section and ignored" << endl;
+    }
+
+    if (pages.empty()) {
+        throw UpdiException("No image data inside the section");
+    }
+
+    cout << pages.size() << " pages to write, " << skipped
+         << " pages outside the section skipped" << endl;
+
+    // Erase-write the image pages and erase the rest of the section,
+    // including gaps between image pages
+    write_pages(nvm, pages, true);
+    report.pages_written = pages.size();
+
+    auto     next_page = pages.begin();
+    uint32_t erase_start = range.offset;
+    for (uint32_t addr = range.offset; addr < range.offset + range.size;
+         addr += page_size) {
+        if (next_page == pages.end() || next_page->address != addr) {
+            continue;
+        }
+
+        if (addr > erase_start) {
+            nvm.erase_flash(erase_start, addr - erase_start);
+        }
+        erase_start = addr + page_size;
+        next_page++;
+    }
+    if (erase_start < range.offset + range.size) {
+        nvm.erase_flash(erase_start, range.offset + range.size - erase_start);
+    }
+
+    // Only the written pages are verified
+    verify_pages(nvm, pages);
+}
+
+void ProgrammingJob::write_extra_pages(
+    NvmProgrammer&             nvm,
+    const vector<ProgramPage>& pages) const {
+    auto device = nvm.get_device();
+
+    // Unit data outside the image, erase-written since it may not be covered
+    // by the chip erase (section flashing, resumed journal)
+    for (auto& page : pages) {
+        if (page.address + page.pageSize > device->get_flash_size()) {
+            stringstream ss;
+            ss << "Unit data at 0x" << hex << page.address
+               << " exceeds the flash";
+            throw UpdiException(ss.str());
+        }
+
+        vector<ProgramPage> single(1, page);
+        write_pages(nvm, single, true);
+        verify_pages(nvm, single);
+    }
+}
+
+void ProgrammingJob::write_pages(NvmProgrammer&             nvm,
+                                 const vector<ProgramPage>& pages,
+                                 bool                       erase_pages) const {
+    uint32_t address = pages.front().address;
+
+    nvm.write_flash(address, pages, _progress, CancellationToken(),
+                    erase_pages);
+}
+
+void ProgrammingJob::verify_pages(NvmProgrammer&             nvm,
+                                  const vector<ProgramPage>& pages) const {
+    auto     device = nvm.get_device();
+    uint32_t page_size = device->get_flash_pagesize();
+
+    // Contiguous pages are read back in one go
+    for (size_t first = 0; first < pages.size();) {
+        size_t last = first;
+        while (last + 1 < pages.size() &&
+               pages[last + 1].address ==
+                   pages[last].address + pages[last].pageSize) {
+            last++;
+        }
+
+        uint32_t read_addr = pages[first].address;
+        if (read_addr < device->get_flash_start_addr()) {
+            read_addr += device->get_flash_start_addr();
+        }
+
+        uint32_t        size = (last - first + 1) * page_size;
+        vector<uint8_t> flash_data = nvm.read_flash(read_addr, size, _progress);
+
+        auto it = flash_data.begin();
+        for (size_t n = first; n <= last; n++) {
+            auto& page = pages[n];
+            if (!std::equal(page.data, page.data + page.pageSize, it)) {
+                stringstream ss;
+                ss << "Flash verification error at 0x" << hex << page.address;
+                throw UpdiException(ss.str());
+            }
+            it += page.pageSize;
+        }
+
+        first = last + 1;
+    }
+}
+
+void ProgrammingJob::verify_hashes(
+    NvmProgrammer&                 nvm,
+    const map<uint32_t, uint64_t>& page_hashes) const {
+    auto     device = nvm.get_device();
+    uint32_t page_size = device->get_flash_pagesize();
+
+    // Contiguous pages are read back in one go
+    for (auto first = page_hashes.begin(); first != page_hashes.end();) {
+        auto     last = first;
+        uint32_t count = 1;
+        while (next(last) != page_hashes.end() &&
+               next(last)->first == last->first + page_size) {
+            last++;
+            count++;
+        }
+
+        uint32_t read_addr = first->first;
+        if (read_addr < device->get_flash_start_addr()) {
+            read_addr += device->get_flash_start_addr();
+        }
+
+        vector<uint8_t> flash_data =
+            nvm.read_flash(read_addr, count * page_size, _progress);
+
+        const uint8_t* data = flash_data.data();
+        for (auto it = first; it != next(last); it++) {
+            if (ProgrammingPlan::page_hash(data, page_size) != it->second) {
+                stringstream ss;
+                ss << "Flash verification error at 0x" << hex << it->first;
+                throw UpdiException(ss.str());
+            }
+            data += page_size;
+        }
+
+        first = next(last);
+    }
+}
+
+void ProgrammingJob::write_byte_memories(NvmProgrammer& nvm) const {
+    uint32_t pages_written = 0;
+
+    // Both memories are only written where the data differs
+    for (auto& segment : _eeprom) {
+        pages_written += nvm.write_eeprom(segment.address, segment.data);
+    }
+    for (auto& segment : _user_row) {
+        pages_written += nvm.write_user_row(segment.address, segment.data);
+    }
+
+    if (!_eeprom.empty() || !_user_row.empty()) {
+        cout << pages_written << " EEPROM and user row pages written" << endl;
+    }
+}
+
+void ProgrammingJob::verify_byte_memories(NvmProgrammer& nvm) const {
+    auto device = nvm.get_device();
+
+    auto verify = [&](const vector<ImageSegment>& segments, uint32_t base_addr,
+                      const char* memory) {
+        for (auto& segment : segments) {
+            if (nvm.read_memory(base_addr + segment.address,
+                                segment.data.size()) != segment.data) {
+                stringstream ss;
+                ss << memory << " verification error at 0x" << hex
+                   << segment.address;
+                throw UpdiException(ss.str());
+            }
+        }
+    };
+
+    verify(_eeprom, device->get_eeprom_addr(), "EEPROM");
+    verify(_user_row, device->get_userrow_addr(), "User row");
+}
+
+}  // namespace updi
@@ -0,0 +1,235 @@
+#include "programming_plan.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace updi {
+
+constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+constexpr uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+// Link cost model: every byte sent is echoed on the single wire line as a
+// 12 bit frame, and every transaction waits for the serial adapter to turn
+// the line around
+constexpr uint64_t UPDI_FRAME_BITS = 12;
+constexpr uint64_t TURNAROUND_US = 1000;
+
+// Flash ready polls, page buffer clear, pointer, repeat, response signature
+// off/on and the NVM command around the page data
+constexpr uint32_t PAGE_WRITE_OVERHEAD_BYTES = 32;
+constexpr uint32_t PAGE_WRITE_TRANSACTIONS = 8;
+
+// Pointer, repeat and load before the page data
+constexpr uint32_t PAGE_READ_OVERHEAD_BYTES = 9;
+constexpr uint32_t PAGE_READ_TRANSACTIONS = 2;
+
+// Flash ready polls, page selection and the NVM command
+constexpr uint32_t PAGE_ERASE_OVERHEAD_BYTES = 20;
+constexpr uint32_t PAGE_ERASE_TRANSACTIONS = 5;
+
+// NVM command and status polls
+constexpr uint32_t CHIP_ERASE_OVERHEAD_BYTES = 12;
+constexpr uint32_t CHIP_ERASE_TRANSACTIONS = 4;
+
+static uint64_t link_us(uint32_t baud_rate,
+                        uint32_t bytes,
+                        uint32_t transactions) {
+    return (uint64_t)bytes * UPDI_FRAME_BITS * 1000000 / baud_rate +
+           transactions * TURNAROUND_US;
+}
+
+static PlanEstimate to_estimate(uint64_t erase_us,
+                                uint64_t write_us,
+                                uint64_t verify_us) {
+    PlanEstimate estimate;
+
+    estimate.erase_ms = (erase_us + 999) / 1000;
+    estimate.write_ms = (write_us + 999) / 1000;
+    estimate.verify_ms = (verify_us + 999) / 1000;
+    estimate.total_ms =
+        estimate.erase_ms + estimate.write_ms + estimate.verify_ms;
+    return estimate;
+}
+
+ProgrammingPlan::ProgrammingPlan()
+    : _baud_rate(0),
+      _strategy(ERASE_STRATEGY_CHIP),
+      _skipped(0),
+      _estimate({0, 0, 0, 0}),
+      _chip_estimate({0, 0, 0, 0}),
+      _pages_estimate({0, 0, 0, 0}) {
+}
+
+ProgrammingPlan::~ProgrammingPlan() {
+}
+
+uint64_t ProgrammingPlan::page_hash(const uint8_t* data, size_t size) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+map<uint32_t, uint64_t> ProgrammingPlan::image_state(
+    const vector<ProgramPage>& pages,
+    uint32_t                   flash_size,
+    uint32_t                   page_size) {
+    map<uint32_t, uint64_t> state;
+    vector<uint8_t>         blank(page_size, 0xFF);
+    uint64_t                blank_hash = page_hash(blank.data(), page_size);
+
+    for (uint32_t addr = 0; addr < flash_size; addr += page_size) {
+        state[addr] = blank_hash;
+    }
+    for (auto& page : pages) {
+        state[page.address] = page_hash(page.data, page.pageSize);
+    }
+
+    return state;
+}
+
+void ProgrammingPlan::build(AvrDevice&                 device,
+                            uint32_t                   baud_rate,
+                            const vector<ProgramPage>& pages,
+                            const vector<uint64_t>*    page_hashes) {
+    uint32_t        page_size = device.get_flash_pagesize();
+    vector<uint8_t> blank(page_size, 0xFF);
+    uint64_t        blank_hash = page_hash(blank.data(), page_size);
+    uint64_t        page_write_us =
+        link_us(baud_rate, page_size + PAGE_WRITE_OVERHEAD_BYTES,
+                PAGE_WRITE_TRANSACTIONS) +
+        device.get_page_write_ms() * 1000;
+    uint64_t page_erase_us = device.get_page_erase_ms() * 1000;
+    uint64_t page_read_us = link_us(baud_rate,
+                                    page_size + PAGE_READ_OVERHEAD_BYTES,
+                                    PAGE_READ_TRANSACTIONS);
+
+    _device_name = device.get_name();
+    _baud_rate = baud_rate;
+
+    // Blank pages are told apart by their hash as well
+    vector<uint64_t> computed_hashes;
+    if (!page_hashes) {
+        for (auto& page : pages) {
+            computed_hashes.push_back(page_hash(page.data, page.pageSize));
+        }
+        page_hashes = &computed_hashes;
+    }
+    auto& hashes = *page_hashes;
+
+    // Chip erase: every page holding data is written once
+    vector<PageAction> chip_actions;
+    uint64_t           chip_writes = 0;
+    for (size_t n = 0; n < pages.size(); n++) {
+        chip_actions.push_back(hashes[n] == blank_hash ? PAGE_SKIP
+                                                       : PAGE_WRITE);
+        chip_writes += chip_actions.back() == PAGE_WRITE;
+    }
+    _chip_estimate = to_estimate(
+        link_us(baud_rate, CHIP_ERASE_OVERHEAD_BYTES,
+                CHIP_ERASE_TRANSACTIONS) +
+            device.get_chip_erase_ms() * 1000,
+        chip_writes * page_write_us, chip_writes * page_read_us);
+
+    // Page erase-write: only pages differing from the unit are touched,
+    // and data outside the image is erased to end up as after a chip erase
+    vector<PageAction> page_actions;
+    vector<uint32_t>   erase_pages;
+    uint64_t           page_writes = 0;
+    uint64_t           page_erases = 0;
+    for (size_t n = 0; n < pages.size(); n++) {
+        auto it = _state.find(pages[n].address);
+        if (it == _state.end()) {
+            page_actions.push_back(PAGE_ERASE_WRITE);
+        } else if (it->second == hashes[n]) {
+            page_actions.push_back(PAGE_SKIP);
+        } else if (it->second == blank_hash) {
+            page_actions.push_back(PAGE_WRITE);
+        } else {
+            page_actions.push_back(PAGE_ERASE_WRITE);
+        }
+        page_writes += page_actions.back() != PAGE_SKIP;
+        page_erases += page_actions.back() == PAGE_ERASE_WRITE;
+    }
+
+    auto next_page = pages.begin();
+    for (uint32_t addr = 0; addr < device.get_flash_size();
+         addr += page_size) {
+        if (next_page != pages.end() && next_page->address == addr) {
+            next_page++;
+            continue;
+        }
+
+        auto it = _state.find(addr);
+        if (it == _state.end() || it->second != blank_hash) {
+            erase_pages.push_back(addr);
+        }
+    }
+    _pages_estimate = to_estimate(
+        erase_pages.size() *
+                (link_us(baud_rate, PAGE_ERASE_OVERHEAD_BYTES,
+                         PAGE_ERASE_TRANSACTIONS) +
+                 page_erase_us) +
+            page_erases * page_erase_us,
+        page_writes * page_write_us, page_writes * page_read_us);
+
+    if (_pages_estimate.total_ms < _chip_estimate.total_ms) {
+        _strategy = ERASE_STRATEGY_PAGES;
+        _actions = page_actions;
+        _erase_pages = erase_pages;
+        _estimate = _pages_estimate;
+    } else {
+        _strategy = ERASE_STRATEGY_CHIP;
+        _actions = chip_actions;
+        _erase_pages.clear();
+        _estimate = _chip_estimate;
+    }
+
+    _write_pages.clear();
+    for (size_t i = 0; i < _actions.size(); i++) {
+        if (_actions[i] != PAGE_SKIP) {
+            _write_pages.push_back(i);
+        }
+    }
+    _skipped = _actions.size() - _write_pages.size();
+}
+
+bool ProgrammingPlan::needs_erase(size_t index) const {
+    return _actions[index] == PAGE_ERASE_WRITE;
+}
+
+void ProgrammingPlan::print(ostream& os) const {
+    uint32_t erase_writes = count(_actions.begin(), _actions.end(),
+                                  PAGE_ERASE_WRITE);
+
+    os << "Programming plan for " << _device_name << " at " << _baud_rate
+       << " baud:" << endl;
+    os << "  Erase:    "
+       << (_strategy == ERASE_STRATEGY_CHIP ? "chip erase"
+                                            : "page erase-write")
+       << endl;
+    os << "  Write:    " << _write_pages.size() << " pages";
+    if (erase_writes) {
+        os << " (" << erase_writes << " erase-write)";
+    }
+    os << endl;
+    if (!_erase_pages.empty()) {
+        os << "  Clear:    " << _erase_pages.size()
+           << " pages outside the image" << endl;
+    }
+    os << "  Skip:     " << _skipped << " pages" << endl;
+    os << "  Verify:   readback of " << _write_pages.size() << " pages"
+       << endl;
+    os << "  Estimate: " << _estimate.total_ms << " ms (erase "
+       << _estimate.erase_ms << " ms, write " << _estimate.write_ms
+       << " ms, verify " << _estimate.verify_ms << " ms)" << endl;
+    os << "  Chip erase " << _chip_estimate.total_ms
+       << " ms, page erase-write " << _pages_estimate.total_ms << " ms"
+       << endl;
+}
+
+}  // namespace updi
@@ -0,0 +1,305 @@
+#include "unit_serializer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace updi {
+
+static string trim(const string& s) {
+    size_t first = s.find_first_not_of(" \t\r\n");
+    if (first == string::npos) {
+        return "";
+    }
+
+    size_t last = s.find_last_not_of(" \t\r\n");
+    return s.substr(first, last - first + 1);
+}
+
+static vector<string> split(const string& line) {
+    vector<string> items;
+    stringstream   ss(line);
+    string         item;
+
+    while (getline(ss, item, ',')) {
+        items.push_back(trim(item));
+    }
+
+    return items;
+}
+
+// The rename itself only survives a power loss once the directory is synced
+static void sync_directory(const string& filename) {
+    size_t slash = filename.rfind('/');
+    string directory = slash == string::npos ? "." : filename.substr(0, slash);
+    int    dir_fd = ::open(directory.empty() ? "/" : directory.c_str(),
+                           O_RDONLY | O_DIRECTORY);
+
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+// Replace the file content in one step, so neither a crash nor a power loss
+// leaves it empty or rolls a counter back
+static void write_file(const string& filename, const string& content) {
+    string tmp_name = filename + ".tmp";
+    string data = content + "\n";
+    size_t done = 0;
+    int    fd = ::open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    while (fd >= 0 && done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        done += n > 0 ? n : 0;
+    }
+
+    bool written = fd >= 0 && done == data.size() && fsync(fd) == 0;
+    if (fd >= 0 && close(fd) != 0) {
+        written = false;
+    }
+    if (!written || rename(tmp_name.c_str(), filename.c_str()) != 0) {
+        remove(tmp_name.c_str());
+        stringstream ss;
+        ss << "failed to write file " << filename;
+        throw ios_base::failure(ss.str());
+    }
+    sync_directory(filename);
+}
+
+static void put_le(map<uint32_t, uint8_t>& data,
+                   const SerialField&      field,
+                   uint64_t                value) {
+    for (uint32_t i = 0; i < field.size; i++) {
+        data[field.address + i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+UnitSerializer::UnitSerializer()
+    : counter_field({0, 0}),
+      counter(0),
+      csv_next(0),
+      use_timestamp(false),
+      timestamp_field({0, 0}) {
+}
+
+UnitSerializer::~UnitSerializer() {
+}
+
+SerialField UnitSerializer::parse_field(const string& description) {
+    SerialField field;
+    size_t      separator = description.find(':');
+
+    try {
+        if (separator == string::npos) {
+            throw invalid_argument("");
+        }
+        field.address = stoul(description.substr(0, separator), nullptr, 0);
+        field.size = stoul(description.substr(separator + 1), nullptr, 0);
+    } catch (const logic_error& e) {
+        throw invalid_argument("Invalid field " + description +
+                               ", expected <address>:<size>");
+    }
+
+    if (field.size == 0) {
+        throw invalid_argument("Invalid field size in " + description);
+    }
+
+    return field;
+}
+
+void UnitSerializer::set_counter(const string&      filename,
+                                 const SerialField& field) {
+    ifstream file(filename.c_str());
+    string   line;
+
+    if (field.size > 8) {
+        throw invalid_argument("Serial number is limited to 8 bytes");
+    }
+
+    if (!file.is_open() || !getline(file, line)) {
+        stringstream ss;
+        ss << "failed to read file " << filename;
+        throw ios_base::failure(ss.str());
+    }
+
+    try {
+        counter = stoull(trim(line), nullptr, 0);
+    } catch (const logic_error& e) {
+        stringstream ss;
+        ss << filename << ": invalid serial number " << line;
+        throw ios_base::failure(ss.str());
+    }
+
+    counter_file = filename;
+    counter_field = field;
+}
+
+void UnitSerializer::set_csv(const string& filename) {
+    ifstream file(filename.c_str());
+    string   line;
+    int      line_number = 1;
+
+    if (!file.is_open() || !getline(file, line)) {
+        stringstream ss;
+        ss << "failed to read file " << filename;
+        throw ios_base::failure(ss.str());
+    }
+
+    csv_fields.clear();
+    csv_rows.clear();
+    try {
+        for (auto& item : split(line)) {
+            csv_fields.push_back(parse_field(item));
+        }
+    } catch (const invalid_argument& e) {
+        stringstream ss;
+        ss << filename << ":1: " << e.what();
+        throw ios_base::failure(ss.str());
+    }
+
+    while (getline(file, line)) {
+        line_number++;
+        if (trim(line).empty()) {
+            continue;
+        }
+
+        auto row = split(line);
+        bool valid = row.size() == csv_fields.size();
+        for (size_t i = 0; valid && i < row.size(); i++) {
+            valid = row[i].size() == 2 * csv_fields[i].size &&
+                    all_of(row[i].begin(), row[i].end(), [](char c) {
+                        return isxdigit(static_cast<unsigned char>(c)) != 0;
+                    });
+        }
+
+        if (!valid) {
+            stringstream ss;
+            ss << filename << ":" << line_number
+               << ": expected one hex value per field";
+            throw ios_base::failure(ss.str());
+        }
+        csv_rows.push_back(row);
+    }
+
+    // Units already programmed are skipped
+    ifstream next_file((filename + ".next").c_str());
+    if (!(next_file >> csv_next)) {
+        csv_next = 0;
+    }
+
+    csv_file = filename;
+}
+
+void UnitSerializer::set_timestamp(const SerialField& field) {
+    if (field.size > 8) {
+        throw invalid_argument("Timestamp is limited to 8 bytes");
+    }
+
+    use_timestamp = true;
+    timestamp_field = field;
+}
+
+map<uint32_t, uint8_t> UnitSerializer::next_unit() {
+    lock_guard<std::mutex> guard(lock);
+    map<uint32_t, uint8_t> data;
+
+    if (!csv_file.empty()) {
+        if (csv_next >= csv_rows.size()) {
+            throw ios_base::failure("no more unit data in " + csv_file);
+        }
+
+        auto& row = csv_rows[csv_next];
+        for (size_t i = 0; i < row.size(); i++) {
+            for (uint32_t n = 0; n < csv_fields[i].size; n++) {
+                data[csv_fields[i].address + n] =
+                    stoul(row[i].substr(2 * n, 2), nullptr, 16);
+            }
+        }
+
+        write_file(csv_file + ".next", to_string(csv_next + 1));
+        csv_next++;
+    }
+
+    if (!counter_file.empty()) {
+        put_le(data, counter_field, counter);
+        write_file(counter_file, to_string(counter + 1));
+        counter++;
+    }
+
+    if (use_timestamp) {
+        put_le(data, timestamp_field, time(nullptr));
+    }
+
+    return data;
+}
+
+void UnitSerializer::patch_pages(const vector<ProgramPage>&    pages,
+                                 const map<uint32_t, uint8_t>& data,
+                                 uint32_t                      page_size,
+                                 vector<ProgramPage>&          unit_pages,
+                                 vector<ProgramPage>&          extra_pages,
+                                 vector<uint8_t>&              page_data) {
+    // Touched page address to its index in the image pages, the page count
+    // for pages outside the image
+    map<uint32_t, size_t> touched;
+    map<uint32_t, size_t> offsets;
+
+    unit_pages = pages;
+    extra_pages.clear();
+
+    for (auto& byte : data) {
+        // Image pages are sorted by address
+        uint32_t page_addr = byte.first - byte.first % page_size;
+        auto     page = lower_bound(unit_pages.begin(), unit_pages.end(),
+                                    page_addr,
+                                    [](const ProgramPage& p, uint32_t addr) {
+                                        return p.address < addr;
+                                    });
+        touched[page_addr] =
+            page != unit_pages.end() && page->address == page_addr
+                ? page - unit_pages.begin()
+                : unit_pages.size();
+    }
+
+    // All copies are allocated at once, so the page views stay valid
+    page_data.assign(touched.size() * page_size, 0xFF);
+    for (auto& page : touched) {
+        size_t   offset = offsets.size() * page_size;
+        uint8_t* copy_data = &page_data[offset];
+
+        if (page.second < unit_pages.size()) {
+            auto& unit_page = unit_pages[page.second];
+            copy(unit_page.data, unit_page.data + unit_page.pageSize,
+                 copy_data);
+            unit_page.data = copy_data;
+        } else {
+            ProgramPage extra;
+            extra.address = page.first;
+            extra.pageSize = page_size;
+            extra.data = copy_data;
+            extra_pages.push_back(extra);
+        }
+        offsets[page.first] = offset;
+    }
+
+    for (auto& byte : data) {
+        uint32_t page_addr = byte.first - byte.first % page_size;
+        page_data[offsets[page_addr] + byte.first - page_addr] = byte.second;
+    }
+}
+
+}  // namespace updi
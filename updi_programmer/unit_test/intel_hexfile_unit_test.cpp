@@ -11,6 +11,7 @@ namespace updi {
 
 using testing::AllOf;
 using testing::Gt;
+using testing::HasSubstr;
 using testing::Le;
 using testing::Lt;
 using testing::Values;
@@ -18,6 +19,8 @@ using testing::Values;
 #define FLASH_SIZE 4 * 1024
 #define TINY_FLASH_SIZE 1024
 #define FLASH_PAGE_SIZE 64
+#define DX_FLASH_SIZE 128 * 1024
+#define DX_FLASH_PAGE_SIZE 512
 
 TEST(IntelHexFileTest, ParseFileSuccessfully) {
     IntelHexFile hex_file(FLASH_SIZE, FLASH_PAGE_SIZE);
@@ -41,6 +44,94 @@ TEST(IntelHexFileTest, WrongHexFile) {
         << "No exception is thrown";
 }
 
+// Load pre-defined wrong intel hex files
+// and check the error points at the offending character
+TEST(IntelHexFileTest, ReportErrorPosition) {
+    IntelHexFile hex_file(FLASH_SIZE, FLASH_PAGE_SIZE);
+
+    try {
+        hex_file.load_file("/usr/bin/invalid_digit.hex");
+        ADD_FAILURE() << "No exception is thrown";
+    } catch (const ios_base::failure& e) {
+        EXPECT_THAT(e.what(), HasSubstr("invalid_digit.hex:2:22: Invalid hex digit"));
+    }
+
+    try {
+        hex_file.load_file("/usr/bin/wrong_checksum.hex");
+        ADD_FAILURE() << "No exception is thrown";
+    } catch (const ios_base::failure& e) {
+        EXPECT_THAT(e.what(), HasSubstr("wrong_checksum.hex:2:42: Failed to verify checksum"));
+    }
+}
+
+// Load a pre-defined intel hex file with extended segment (02) and
+// extended linear (04) address records beyond 64 KB.
+// Expect pages only where the image holds data, padded with 0xFF
+TEST(IntelHexFileTest, ExtendedAddressRecords) {
+    IntelHexFile hex_file(DX_FLASH_SIZE, DX_FLASH_PAGE_SIZE);
+    int start_address = hex_file.load_file("/usr/bin/extended_address.hex");
+
+    EXPECT_EQ(0, start_address) << "Start offset is " << start_address;
+    EXPECT_EQ((size_t)3, hex_file.get_segments().size())
+        << "Actual segment number is " << hex_file.get_segments().size();
+
+    auto& pages = hex_file.get_page_data();
+    ASSERT_EQ((size_t)3, pages.size())
+        << "Actual page number is " << pages.size();
+    EXPECT_EQ((size_t)0x00000, pages[0].address);
+    EXPECT_EQ((size_t)0x10000, pages[1].address);
+    EXPECT_EQ((size_t)0x18000, pages[2].address);
+
+    EXPECT_EQ(0x0C, pages[0].data[0]);
+    EXPECT_EQ(0xFF, pages[0].data[4]);
+    EXPECT_EQ(0x11, pages[1].data[0x10]);
+    EXPECT_EQ(0x44, pages[1].data[0x13]);
+    EXPECT_EQ(0xFF, pages[2].data[0x03]);
+    EXPECT_EQ(0xAA, pages[2].data[0x04]);
+    EXPECT_EQ(0xBB, pages[2].data[0x05]);
+}
+
+// Merge pre-defined bootloader and application hex files,
+// which overlap with identical data.
+// Expect one page set holding the data of both files
+TEST(IntelHexFileTest, MergeHexFiles) {
+    IntelHexFile hex_file(FLASH_SIZE, FLASH_PAGE_SIZE);
+    int start_address = hex_file.load_files(
+        {"/usr/bin/merge_boot.hex", "/usr/bin/merge_app.hex"});
+
+    EXPECT_EQ(0, start_address) << "Start offset is " << start_address;
+
+    auto& pages = hex_file.get_page_data();
+    ASSERT_EQ((size_t)3, pages.size())
+        << "Actual page number is " << pages.size();
+    EXPECT_EQ((size_t)0x000, pages[0].address);
+    EXPECT_EQ((size_t)0x040, pages[1].address);
+    EXPECT_EQ((size_t)0x100, pages[2].address);
+
+    EXPECT_EQ(0x0C, pages[0].data[0]);
+    EXPECT_EQ(0x04, pages[1].data[3]);
+    EXPECT_EQ(0x06, pages[1].data[5]);
+    EXPECT_EQ(0xFF, pages[1].data[6]);
+    EXPECT_EQ(0x44, pages[2].data[3]);
+}
+
+// Merge pre-defined hex files holding different data at the same addresses.
+// Expect class to throw an exception naming the range and both files
+TEST(IntelHexFileTest, MergeConflict) {
+    IntelHexFile hex_file(FLASH_SIZE, FLASH_PAGE_SIZE);
+
+    try {
+        hex_file.load_files(
+            {"/usr/bin/merge_app.hex", "/usr/bin/merge_conflict.hex"});
+        ADD_FAILURE() << "No exception is thrown";
+    } catch (const ios_base::failure& e) {
+        EXPECT_THAT(e.what(), HasSubstr("merge_conflict.hex: data at "
+                                        "0x43-0x43 conflicts with "
+                                        "/usr/bin/merge_app.hex"));
+        EXPECT_THAT(e.what(), HasSubstr("(2 conflicting ranges)"));
+    }
+}
+
 // Load a pre-defined correct intel hex file
 // but initial flash size to a small value.
 // Expect class to throw an exception
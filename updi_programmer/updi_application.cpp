@@ -3,8 +3,6 @@
 #include <chrono>
 #include <iostream>
 
-#include <unistd.h>
-
 #include "updi_common.h"
 
 using namespace std;
@@ -14,9 +12,11 @@ namespace updi {
 
 UpdiApplication::UpdiApplication(const string&                port,
                                  uint32_t                     baud_rate,
-                                 const shared_ptr<AvrDevice>& device)
-    : _avr_device(device), _pdi_v2(false) {
-    _updi_instruction = make_unique<UpdiInstruction>(port, baud_rate);
+                                 const shared_ptr<AvrDevice>& device,
+                                 const shared_ptr<Deadline>&  deadline)
+    : _avr_device(device), _deadline(deadline), _pdi_v2(false), _quiet(false) {
+    _updi_instruction =
+        make_unique<UpdiInstruction>(port, baud_rate, deadline);
 }
 
 UpdiApplication::~UpdiApplication() {
@@ -87,8 +87,10 @@ void UpdiApplication::enter_progmode() {
 
     cout << "Wait for NVMGPROG status" << endl;
 
+    // Poll tightly, every ldcs round trip paces the loop already
     // Timeout 1s
-    auto start = system_clock::now();
+    auto     start = steady_clock::now();
+    uint32_t timeout = _deadline->limit(1000);
     while (1) {
         uint8_t key_status = _updi_instruction->ldcs(UPDI_ASI_KEY_STATUS);
         key_status &= (1 << UPDI_ASI_KEY_STATUS_NVMPROG);
@@ -97,11 +99,11 @@ void UpdiApplication::enter_progmode() {
         }
 
         auto duration =
-            duration_cast<milliseconds>(system_clock::now() - start).count();
-        if (duration > 1000) {
+            duration_cast<milliseconds>(steady_clock::now() - start).count();
+        if (duration > timeout) {
+            _deadline->check();
             break;
         }
-        usleep(10 * 1000);
     }
 
     if (!in_prog_mode()) {
@@ -116,7 +118,10 @@ void UpdiApplication::leave_progmode() {
     reset(true);
     reset(false);
 
-    // Disable UPDI
+    disable_updi();
+}
+
+void UpdiApplication::disable_updi() {
     _updi_instruction->stcs(UPDI_CS_CTRLB, (1 << UPDI_CTRLB_UPDIDIS_BIT) |
                                                (1 << UPDI_CTRLB_CCDETDIS_BIT));
 }
@@ -137,7 +142,8 @@ void UpdiApplication::reset(bool apply_reset) {
 
         // Wait for reset to complete
         // Timeout 500ms
-        auto start = system_clock::now();
+        auto     start = steady_clock::now();
+        uint32_t timeout = _deadline->limit(500);
         while (1) {
             uint8_t sys_status = _updi_instruction->ldcs(UPDI_ASI_SYS_STATUS);
             sys_status &= (1 << UPDI_ASI_SYS_STATUS_RSTSYS);
@@ -146,16 +152,24 @@ void UpdiApplication::reset(bool apply_reset) {
             }
 
             auto duration =
-                duration_cast<milliseconds>(system_clock::now() - start)
+                duration_cast<milliseconds>(steady_clock::now() - start)
                     .count();
-            if (duration > 500) {
+            if (duration > timeout) {
+                _deadline->check();
                 throw UpdiException("Still active reset status");
             }
-            usleep(10 * 1000);
         }
     }
 }
 
+void UpdiApplication::resync_link() {
+    cout << "Resynchronize UPDI link" << endl;
+
+    if (!_updi_instruction->resync()) {
+        throw UpdiException("UPDI link is not responding after double break");
+    }
+}
+
 void UpdiApplication::chip_erase() {
     if (_pdi_v2) {
         throw UpdiException("PDI V2 is not supported now");
@@ -173,8 +187,10 @@ void UpdiApplication::chip_erase() {
     }
 }
 
-void UpdiApplication::write_nvm_page(uint32_t               start_addr,
-                                     const vector<uint8_t>& page_data) {
+void UpdiApplication::write_nvm_page(uint32_t       start_addr,
+                                     const uint8_t* page_data,
+                                     size_t         page_size,
+                                     bool           erase_page) {
     if (_pdi_v2) {
         throw UpdiException("PDI V2 is not supported now");
     }
@@ -183,7 +199,9 @@ void UpdiApplication::write_nvm_page(uint32_t               start_addr,
         throw UpdiException("Waiting for flash ready timed out");
     }
 
-    cout << "Clear page buffer" << endl;
+    if (!_quiet) {
+        cout << "Clear page buffer" << endl;
+    }
     execute_nvm_command(UPDI_V0_NVMCTRL_CTRLA_PAGE_BUFFER_CLR);
 
     if (!wait_flash_ready()) {
@@ -192,10 +210,11 @@ void UpdiApplication::write_nvm_page(uint32_t               start_addr,
     }
 
     // write page data to page buffer
-    write_data_words(start_addr, page_data);
+    write_data_words(start_addr, page_data, page_size);
 
     // write page buffer data to NVM
-    execute_nvm_command(UPDI_V0_NVMCTRL_CTRLA_WRITE_PAGE);
+    execute_nvm_command(erase_page ? UPDI_V0_NVMCTRL_CTRLA_ERASE_WRITE_PAGE
+                                   : UPDI_V0_NVMCTRL_CTRLA_WRITE_PAGE);
 
     if (!wait_flash_ready()) {
         throw UpdiException(
@@ -203,6 +222,54 @@ void UpdiApplication::write_nvm_page(uint32_t               start_addr,
     }
 }
 
+void UpdiApplication::write_eeprom_page(uint32_t               start_addr,
+                                        const vector<uint8_t>& data) {
+    if (_pdi_v2) {
+        throw UpdiException("PDI V2 is not supported now");
+    }
+
+    if (!wait_flash_ready()) {
+        throw UpdiException("Waiting for flash ready timed out");
+    }
+
+    execute_nvm_command(UPDI_V0_NVMCTRL_CTRLA_PAGE_BUFFER_CLR);
+
+    if (!wait_flash_ready()) {
+        throw UpdiException(
+            "Waiting for flash ready after page buffer clear timed out");
+    }
+
+    // EEPROM is byte addressed, the loaded bytes select what is written
+    write_data(start_addr, data);
+    execute_nvm_command(UPDI_V0_NVMCTRL_CTRLA_ERASE_WRITE_PAGE);
+
+    if (!wait_flash_ready()) {
+        throw UpdiException(
+            "Waiting for flash ready after EEPROM write timed out");
+    }
+}
+
+void UpdiApplication::erase_nvm_page(uint32_t start_addr) {
+    if (_pdi_v2) {
+        throw UpdiException("PDI V2 is not supported now");
+    }
+
+    if (!wait_flash_ready()) {
+        throw UpdiException("Waiting for flash ready timed out");
+    }
+
+    // A write to the page buffer selects the page to erase
+    vector<uint8_t> dummy(1, 0xFF);
+    write_data(start_addr, dummy);
+
+    execute_nvm_command(UPDI_V0_NVMCTRL_CTRLA_ERASE_PAGE);
+
+    if (!wait_flash_ready()) {
+        throw UpdiException(
+            "Waiting for flash ready after page erase timed out");
+    }
+}
+
 void UpdiApplication::write_data(uint32_t               address,
                                  const vector<uint8_t>& data) {
     // special case for only writing 1 byte
@@ -230,30 +297,31 @@ void UpdiApplication::write_data(uint32_t               address,
     _updi_instruction->st_ptr_inc(data);
 }
 
-void UpdiApplication::write_data_words(uint32_t               address,
-                                       const vector<uint8_t>& data) {
+void UpdiApplication::write_data_words(uint32_t       address,
+                                       const uint8_t* data,
+                                       size_t         size) {
     // special case for only writing 1 word
-    if (data.size() == 2) {
+    if (size == 2) {
         uint16_t value = ((uint16_t)data[1] << 8) + data[0];
         _updi_instruction->st16(address, value);
         return;
     }
 
-    if ((data.size() % 2) != 0 ) {
+    if ((size % 2) != 0 ) {
         throw UpdiException("Data size should align on word width");
     }
     
     // for repeated word operation, the maximum bytes should be MAX_REPEAT_SIZE
     // *2
-    if (data.size() > (UPDI_MAX_REPEAT_SIZE * 2)) {
+    if (size > (UPDI_MAX_REPEAT_SIZE * 2)) {
         throw UpdiException("Data size exceeds the limits");
     }
 
     _updi_instruction->st_ptr(address);
 
     // Repeat to write the byte array
-    _updi_instruction->repeat(data.size() / 2);
-    _updi_instruction->st_ptr_inc16(data);
+    _updi_instruction->repeat(size / 2);
+    _updi_instruction->st_ptr_inc16(data, size);
 }
 
 vector<uint8_t> UpdiApplication::read_data(uint32_t address,
@@ -303,6 +371,11 @@ void UpdiApplication::write_fuse_data(uint32_t fuse_number, uint8_t value) {
         throw UpdiException("Enter progmode first");
     }
 
+    // A previous fuse write may still be in progress
+    if (!wait_flash_ready()) {
+        throw UpdiException("Waiting for flash ready timed out");
+    }
+
     uint32_t        fuse_addr = fuse_number + _avr_device->get_fuses_addr();
     vector<uint8_t> data;
     data.push_back(fuse_addr & 0xff);
@@ -317,6 +390,11 @@ void UpdiApplication::write_fuse_data(uint32_t fuse_number, uint8_t value) {
     write_data(_avr_device->get_nvmctrl_addr() + UPDI_NVMCTRL_DATAL, data);
 
     execute_nvm_command(UPDI_V0_NVMCTRL_CTRLA_WRITE_FUSE);
+
+    if (!wait_flash_ready()) {
+        throw UpdiException(
+            "Waiting for flash ready after fuse write timed out");
+    }
 }
 
 uint8_t UpdiApplication::read_fuse_data(uint32_t fuse_number) {
@@ -326,7 +404,9 @@ uint8_t UpdiApplication::read_fuse_data(uint32_t fuse_number) {
 }
 
 bool UpdiApplication::wait_unlocked(uint32_t timeout_ms) {
-    auto start = system_clock::now();
+    auto start = steady_clock::now();
+
+    timeout_ms = _deadline->limit(timeout_ms);
 
     while (1) {
         uint8_t asi_status = _updi_instruction->ldcs(UPDI_ASI_SYS_STATUS);
@@ -336,11 +416,11 @@ bool UpdiApplication::wait_unlocked(uint32_t timeout_ms) {
         }
 
         auto duration =
-            duration_cast<milliseconds>(system_clock::now() - start).count();
+            duration_cast<milliseconds>(steady_clock::now() - start).count();
         if (duration > timeout_ms) {
+            _deadline->check();
             break;
         }
-        usleep(5 * 1000);
     }
 
     cout << "Timeout waiting for device to unlock" << endl;
@@ -363,10 +443,13 @@ void UpdiApplication::write_progmode_key() {
 }
 
 bool UpdiApplication::wait_flash_ready() {
-    cout << "Wait flash ready" << endl;
+    if (!_quiet) {
+        cout << "Wait flash ready" << endl;
+    }
 
     // Timeout 10s
-    auto start = system_clock::now();
+    auto     start = steady_clock::now();
+    uint32_t timeout = _deadline->limit(10 * 1000);
     while (1) {
         uint8_t nvm_status = _updi_instruction->ld(
             _avr_device->get_nvmctrl_addr() + UPDI_NVMCTRL_STATUS);
@@ -381,18 +464,20 @@ bool UpdiApplication::wait_flash_ready() {
         }
 
         auto duration =
-            duration_cast<milliseconds>(system_clock::now() - start).count();
-        if (duration > 10 * 1000) {
+            duration_cast<milliseconds>(steady_clock::now() - start).count();
+        if (duration > timeout) {
+            _deadline->check();
             break;
         }
-        usleep(100 * 1000);
     }
 
     return false;
 }
 
 void UpdiApplication::execute_nvm_command(uint8_t command) {
-    cout << "Execute NVMCMD " << command << endl;
+    if (!_quiet) {
+        cout << "Execute NVMCMD " << command << endl;
+    }
 
     _updi_instruction->st(_avr_device->get_nvmctrl_addr() + UPDI_NVMCTRL_CTRLA,
                           command);
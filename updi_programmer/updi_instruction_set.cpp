@@ -1,26 +1,47 @@
 #include "updi_instruction_set.h"
 
+#include <chrono>
 #include <iostream>
 #include <memory>
 
 #include "updi_common.h"
 
 using namespace std;
+using namespace chrono;
 
 namespace updi {
 
-UpdiInstruction::UpdiInstruction(const string& port, uint32_t baud_rate)
-    : _use_24bit_addr(false) {
-    _serial_comm = std::make_unique<UpdiSerial>(port, baud_rate);
-    _serial_comm->send_double_break();
+UpdiInstruction::UpdiInstruction(const string&                port,
+                                 uint32_t                     baud_rate,
+                                 const shared_ptr<Deadline>& deadline)
+    : _use_24bit_addr(false), _bringup_ms(0), _double_break_used(false) {
+    auto start = steady_clock::now();
+
+    // The serial port sends a normal break when it is opened. That is enough
+    // unless UPDI is stuck in an unknown state, so only probe it briefly.
+    _serial_comm = std::make_unique<UpdiSerial>(port, baud_rate, deadline);
+    _serial_comm->set_read_timeout(100);
     init();
 
-    if (!updi_is_ready()) {
-        _serial_comm->send_double_break();
+    bool ready = updi_is_ready();
+    _serial_comm->set_read_timeout(1000);
 
-        // Re-init UDPI
+    if (!ready) {
+        // Fall back to the slow 300 baud double break
+        _double_break_used = true;
+        _serial_comm->send_double_break();
         init();
+
+        if (!updi_is_ready()) {
+            _serial_comm->send_double_break();
+
+            // Re-init UDPI
+            init();
+        }
     }
+
+    _bringup_ms =
+        duration_cast<milliseconds>(steady_clock::now() - start).count();
 }
 
 UpdiInstruction::~UpdiInstruction() {
@@ -280,7 +301,7 @@ void UpdiInstruction::st_ptr_inc(const std::vector<uint8_t>& data) {
     }
 }
 
-void UpdiInstruction::st_ptr_inc16(const std::vector<uint8_t>& data) {
+void UpdiInstruction::st_ptr_inc16(const uint8_t* data, size_t size) {
     vector<uint8_t> cmd;
     vector<uint8_t> response;
     uint8_t         ctrla_ackon = 1 << UPDI_CTRLA_IBDLY_BIT;
@@ -295,7 +316,7 @@ void UpdiInstruction::st_ptr_inc16(const std::vector<uint8_t>& data) {
     _serial_comm->send(cmd);
 
     // No response expected
-    _serial_comm->send(data);
+    _serial_comm->send(data, size);
 
     // Re-enable acks
     stcs(UPDI_CS_CTRLA, ctrla_ackon);
@@ -347,12 +368,42 @@ void UpdiInstruction::init() {
 }
 
 bool UpdiInstruction::updi_is_ready() {
-    if (ldcs(UPDI_CS_STATUSA) != 0) {
-        return true;
+    try {
+        if (ldcs(UPDI_CS_STATUSA) != 0) {
+            return true;
+        }
+    } catch (const UpdiException& e) {
+        // No response at all, handled as not ready
     }
 
     cerr << "UPDI is not ready - reinitialisation required" << endl;
     return false;
 }
 
+bool UpdiInstruction::resync() {
+    _serial_comm->send_double_break();
+    init();
+
+    return updi_is_ready();
+}
+
+bool UpdiInstruction::probe() {
+    bool ready = false;
+
+    _serial_comm->set_read_timeout(100);
+    _serial_comm->set_quiet_timeouts(true);
+    _serial_comm->send_break();
+    init();
+
+    try {
+        ready = ldcs(UPDI_CS_STATUSA) != 0;
+    } catch (const UpdiException& e) {
+        // No target
+    }
+
+    _serial_comm->set_quiet_timeouts(false);
+    _serial_comm->set_read_timeout(1000);
+    return ready;
+}
+
 }  // namespace updi
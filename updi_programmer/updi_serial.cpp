@@ -3,27 +3,39 @@
 #include <error.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 
 #include "updi_common.h"
 
 using namespace std;
+using namespace chrono;
 
 namespace updi {
 
-UpdiSerial::UpdiSerial(const std::string& port, uint32_t baud_rate)
-    : _serial_port(port), _baud_rate(baud_rate) {
+// One UPDI frame: start bit, 8 data bits, parity and 2 stop bits
+constexpr uint32_t UPDI_FRAME_BITS = 12;
+
+UpdiSerial::UpdiSerial(const std::string&               port,
+                       uint32_t                         baud_rate,
+                       const std::shared_ptr<Deadline>& deadline)
+    : _serial_port(port),
+      _baud_rate(baud_rate),
+      _line_baud(baud_rate),
+      _read_timeout_ms(1000),
+      _quiet_timeouts(false),
+      _deadline(deadline) {
     // Open serial comm and setup baud rate/parity/stop bits
     if (init_serial_comm(_baud_rate)) {
         // Send a break as handshake
-        vector<uint8_t> command;
-        command.push_back(UPDI_BREAK);
-        send(command);
+        send_break();
     }
 }
 
@@ -33,28 +45,38 @@ UpdiSerial::~UpdiSerial() {
 }
 
 void UpdiSerial::send(const vector<uint8_t>& command) {
+    send(command.data(), command.size());
+}
+
+void UpdiSerial::send(const uint8_t* data, size_t size) {
     vector<uint8_t> echo;
-    echo.resize(command.size());
-    write(_serial_fd, &command[0], command.size());
+    echo.resize(size);
+    write(_serial_fd, data, size);
 
     // read the echo
-    read(_serial_fd, &echo[0], echo.size());
+    read_bytes(&echo[0], echo.size(),
+               _deadline->limit(_read_timeout_ms + transfer_ms(echo.size())));
 }
 
 void UpdiSerial::receive(vector<uint8_t>& data, uint32_t expected_size) {
-    uint32_t read_count = 0;
     data.resize(expected_size);
+    if (!expected_size) {
+        return;
+    }
 
-    while (read_count < expected_size) {
-        int num_bytes =
-            read(_serial_fd, &data[read_count], expected_size - read_count);
-        if (num_bytes < 0) {
-            cerr << "Error reading: " << strerror(errno) << endl;
-            data.clear();
-            break;
-        }
+    uint32_t timeout =
+        _deadline->limit(_read_timeout_ms + transfer_ms(expected_size));
+    uint32_t read_count = read_bytes(&data[0], expected_size, timeout);
 
-        read_count += num_bytes;
+    // The target is not responding
+    if (read_count < expected_size) {
+        data.resize(read_count);
+        _deadline->check();
+
+        if (!_quiet_timeouts) {
+            cerr << "Timeout reading: received " << read_count << " of "
+                 << expected_size << " bytes" << endl;
+        }
     }
 }
 
@@ -75,6 +97,60 @@ void UpdiSerial::send_double_break() {
     init_serial_comm(_baud_rate);
 }
 
+void UpdiSerial::send_break() {
+    vector<uint8_t> command;
+    command.push_back(UPDI_BREAK);
+    send(command);
+}
+
+void UpdiSerial::set_read_timeout(uint32_t timeout_ms) {
+    _read_timeout_ms = timeout_ms;
+}
+
+uint32_t UpdiSerial::read_bytes(uint8_t* data,
+                                uint32_t size,
+                                uint32_t timeout_ms) {
+    uint32_t read_count = 0;
+    auto     end = steady_clock::now() + milliseconds(timeout_ms);
+
+    // Reads are paced by poll(), VTIME only has 0.1s steps
+    while (read_count < size) {
+        auto remaining =
+            duration_cast<microseconds>(end - steady_clock::now()).count();
+        if (remaining < 0) {
+            break;
+        }
+
+        // Rounded up, poll() must not return before the end of the wait
+        struct pollfd pfd = {_serial_fd, POLLIN, 0};
+        int           ret = poll(&pfd, 1, (remaining + 999) / 1000);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+
+        int num_bytes = read(_serial_fd, data + read_count, size - read_count);
+        if (num_bytes < 0) {
+            cerr << "Error reading: " << strerror(errno) << endl;
+            break;
+        }
+        if (num_bytes == 0) {
+            break;
+        }
+
+        read_count += num_bytes;
+    }
+
+    return read_count;
+}
+
+uint32_t UpdiSerial::transfer_ms(uint32_t size) const {
+    return ((uint64_t)size * UPDI_FRAME_BITS * 1000 + _line_baud - 1) /
+           _line_baud;
+}
+
 bool UpdiSerial::init_serial_comm(uint32_t baud) {
     struct termios tty;
     _serial_fd = open(_serial_port.c_str(), O_RDWR | O_NOCTTY | O_SYNC);
@@ -101,10 +177,11 @@ bool UpdiSerial::init_serial_comm(uint32_t baud) {
 
     tty.c_oflag &= ~(OPOST | ONLCR | OCRNL);
 
-    // 1s timeout
-    tty.c_cc[VTIME] = 10;
+    // Non-blocking reads, timeouts are handled by poll()
+    tty.c_cc[VTIME] = 0;
     tty.c_cc[VMIN] = 0;
 
+    _line_baud = baud;
     switch (baud) {
         case 300:
             cfsetispeed(&tty, B300);
@@ -123,6 +200,7 @@ bool UpdiSerial::init_serial_comm(uint32_t baud) {
             cfsetospeed(&tty, B38400);
             break;
         default:
+            _line_baud = 115200;
             cfsetispeed(&tty, B115200);
             cfsetospeed(&tty, B115200);
             break;